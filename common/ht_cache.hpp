@@ -0,0 +1,348 @@
+#ifndef HT_CACHE_HPP
+#define HT_CACHE_HPP
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// An on-disk feature cache shared by hog_snort and hog_run, keyed by the
+// content of each image file and by the HOG parameters, so repeat runs over
+// unchanged images skip decoding and HOG entirely.
+//
+// Entries live in 256 subdirectories named after the first byte of the key.
+// Every entry is written to a private temporary file and rename()d into
+// place, so several processes can share one cache: readers only ever see
+// complete entries, and racing writers just replace an entry with an
+// identical one. Keys are the first half of a 128-bit hash of the image;
+// every entry also records the second half and the image's length, which
+// lookup() checks, so a collision of keys is a miss rather than another
+// image's features, at the cost of one pass over the image.
+//
+// Hits refresh the entry's mtime. The size of the cache is kept in a
+// 'usage' file, to which each process adds what it stored; trim() only walks
+// the entries, evicting the least recently used ones, once that total goes
+// past the size cap. store() trims every tenth of the cap stored, so a long
+// run never takes the cache far past it.
+
+// Size cap used when --cache-size isn't given, in megabytes.
+static const unsigned int HT_CACHE_DEFAULT_MB = 1024;
+
+// MurmurHash64A (Austin Appleby, public domain).
+static uint64_t murmur_hash64(const void *key, size_t length, uint64_t seed) {
+  const uint64_t m = 0xc6a4a7935bd1e995ULL;
+  const int r = 47;
+  uint64_t h = seed ^ (length * m);
+
+  const unsigned char *data = (const unsigned char *)key;
+  const unsigned char *end = data + (length / 8) * 8;
+  for(; data != end; data += 8) {
+    uint64_t k;
+    memcpy(&k, data, 8);
+    k *= m;
+    k ^= k >> r;
+    k *= m;
+    h ^= k;
+    h *= m;
+  }
+
+  switch(length & 7) {
+    case 7: h ^= uint64_t(data[6]) << 48; // fall through
+    case 6: h ^= uint64_t(data[5]) << 40; // fall through
+    case 5: h ^= uint64_t(data[4]) << 32; // fall through
+    case 4: h ^= uint64_t(data[3]) << 24; // fall through
+    case 3: h ^= uint64_t(data[2]) << 16; // fall through
+    case 2: h ^= uint64_t(data[1]) << 8;  // fall through
+    case 1: h ^= uint64_t(data[0]);
+            h *= m;
+  }
+
+  h ^= h >> r;
+  h *= m;
+  h ^= h >> r;
+  return h;
+}
+
+static inline uint64_t murmur_rotl64(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t murmur_fmix64(uint64_t k) {
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return k;
+}
+
+// MurmurHash3_x64_128 (Austin Appleby, public domain), with a 64-bit seed:
+// two independent 64-bit halves from one pass over the data.
+static void murmur_hash128(const void *key, size_t length, uint64_t seed, uint64_t out[2]) {
+  const uint64_t c1 = 0x87c37b91114253d5ULL;
+  const uint64_t c2 = 0x4cf5ad432745937fULL;
+  uint64_t h1 = seed;
+  uint64_t h2 = seed;
+
+  const unsigned char *data = (const unsigned char *)key;
+  const unsigned char *end = data + (length / 16) * 16;
+  for(; data != end; data += 16) {
+    uint64_t k1, k2;
+    memcpy(&k1, data, 8);
+    memcpy(&k2, data + 8, 8);
+    k1 *= c1; k1 = murmur_rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+    h1 = murmur_rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+    k2 *= c2; k2 = murmur_rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+    h2 = murmur_rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+  }
+
+  uint64_t k1 = 0;
+  uint64_t k2 = 0;
+  switch(length & 15) {
+    case 15: k2 ^= uint64_t(data[14]) << 48; // fall through
+    case 14: k2 ^= uint64_t(data[13]) << 40; // fall through
+    case 13: k2 ^= uint64_t(data[12]) << 32; // fall through
+    case 12: k2 ^= uint64_t(data[11]) << 24; // fall through
+    case 11: k2 ^= uint64_t(data[10]) << 16; // fall through
+    case 10: k2 ^= uint64_t(data[9]) << 8;   // fall through
+    case 9:  k2 ^= uint64_t(data[8]);
+             k2 *= c2; k2 = murmur_rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+             // fall through
+    case 8:  k1 ^= uint64_t(data[7]) << 56; // fall through
+    case 7:  k1 ^= uint64_t(data[6]) << 48; // fall through
+    case 6:  k1 ^= uint64_t(data[5]) << 40; // fall through
+    case 5:  k1 ^= uint64_t(data[4]) << 32; // fall through
+    case 4:  k1 ^= uint64_t(data[3]) << 24; // fall through
+    case 3:  k1 ^= uint64_t(data[2]) << 16; // fall through
+    case 2:  k1 ^= uint64_t(data[1]) << 8;  // fall through
+    case 1:  k1 ^= uint64_t(data[0]);
+             k1 *= c1; k1 = murmur_rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+  }
+
+  h1 ^= length;
+  h2 ^= length;
+  h1 += h2;
+  h2 += h1;
+  h1 = murmur_fmix64(h1);
+  h2 = murmur_fmix64(h2);
+  h1 += h2;
+  h2 += h1;
+  out[0] = h1;
+  out[1] = h2;
+}
+
+// Identifies an image's entry: 'hash' names it, 'check' and 'length' are
+// stored in it and verified.
+struct CacheKey {
+  uint64_t hash;
+  uint64_t check;
+  uint64_t length;
+};
+
+class FeatureCache {
+public:
+  // 'parameters' identifies everything besides the image content that
+  // affects the features (window size, HOG layout, implementation).
+  FeatureCache(const std::string &dir, unsigned long long capacity, const std::string &parameters)
+      : dir(dir), capacity(capacity),
+        parameterHash(murmur_hash64(parameters.data(), parameters.size(), 0)), added(0) {
+  }
+
+  bool open() {
+    if(mkdir(dir.c_str(), 0777) != 0 && errno != EEXIST) {
+      return false;
+    }
+    for(int i = 0; i < 256; ++i) {
+      char sub[4];
+      snprintf(sub, sizeof(sub), "%02x", i);
+      std::string path = dir + "/" + sub;
+      if(mkdir(path.c_str(), 0777) != 0 && errno != EEXIST) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  CacheKey key_for(const std::vector<unsigned char> &content) const {
+    CacheKey key;
+    uint64_t hash[2];
+    murmur_hash128(content.data(), content.size(), parameterHash, hash);
+    key.hash = hash[0];
+    key.check = hash[1];
+    key.length = content.size();
+    return key;
+  }
+
+  bool lookup(const CacheKey &key, std::vector<float> &features) const {
+    std::string path = entry_path(key.hash);
+    FILE *f = fopen(path.c_str(), "rb");
+    if(f == NULL) {
+      return false;
+    }
+    char magic[8];
+    CacheKey stored;
+    uint32_t count = 0;
+    bool ok = fread(magic, 1, 8, f) == 8 && memcmp(magic, "HOGCACH2", 8) == 0 &&
+              fread(&stored, sizeof(stored), 1, f) == 1 && stored.hash == key.hash &&
+              stored.check == key.check && stored.length == key.length &&
+              fread(&count, sizeof(count), 1, f) == 1;
+    if(ok) {
+      features.resize(count);
+      ok = fread(features.data(), sizeof(float), count, f) == count;
+    }
+    fclose(f);
+    if(ok) {
+      // Mark the entry as recently used:
+      utimensat(AT_FDCWD, path.c_str(), NULL, 0);
+    }
+    return ok;
+  }
+
+  void store(const CacheKey &key, const std::vector<float> &features) const {
+    std::string path = entry_path(key.hash);
+    char suffix[64];
+    snprintf(suffix, sizeof(suffix), ".tmp.%d.%zx", (int)getpid(),
+             std::hash<std::thread::id>()(std::this_thread::get_id()));
+    std::string tempPath = path + suffix;
+
+    FILE *f = fopen(tempPath.c_str(), "wb");
+    if(f == NULL) {
+      return;
+    }
+    uint32_t count = features.size();
+    bool ok = fwrite("HOGCACH2", 1, 8, f) == 8 &&
+              fwrite(&key, sizeof(key), 1, f) == 1 &&
+              fwrite(&count, sizeof(count), 1, f) == 1 &&
+              fwrite(features.data(), sizeof(float), count, f) == count;
+    ok = fclose(f) == 0 && ok;
+    if(!ok || rename(tempPath.c_str(), path.c_str()) != 0) {
+      unlink(tempPath.c_str());
+      return;
+    }
+    unsigned long long total = added += 8 + sizeof(key) + sizeof(count) + (unsigned long long)count * sizeof(float);
+    if(total >= capacity / 10) {
+      // Only one thread needs to trim; the others carry on storing:
+      std::unique_lock<std::mutex> hold(trimLock, std::try_to_lock);
+      if(hold.owns_lock()) {
+        trim();
+      }
+    }
+  }
+
+  // Add what this process stored to the cache's recorded size, and evict
+  // entries if that puts it over its capacity. Entries replaced by racing
+  // writers are counted twice, which only makes the next eviction come
+  // sooner; evicting recounts the cache from scratch.
+  void trim() const {
+    std::string usagePath = dir + "/usage";
+    int fd = ::open(usagePath.c_str(), O_RDWR | O_CREAT, 0666);
+    if(fd < 0) {
+      return;
+    }
+    flock(fd, LOCK_EX);
+    char text[32] = {0};
+    unsigned long long total = 0;
+    bool known = pread(fd, text, sizeof(text) - 1, 0) > 0 && sscanf(text, "%llu", &total) == 1;
+    total = total + added.exchange(0);
+    if(!known || total > capacity) {
+      total = evict();
+    }
+    int length = snprintf(text, sizeof(text), "%llu\n", total);
+    if(pwrite(fd, text, length, 0) == length) {
+      ftruncate(fd, length);
+    }
+    flock(fd, LOCK_UN);
+    close(fd);
+  }
+
+  const std::string &get_dir() const {
+    return dir;
+  }
+
+private:
+  // Evict least recently used entries until the cache is back under 90% of
+  // its capacity, and return its size. Safe to run concurrently with other
+  // processes using the cache; entries that vanish underneath us are simply
+  // skipped.
+  unsigned long long evict() const {
+    struct Entry {
+      time_t mtime;
+      unsigned long long size;
+      std::string path;
+      bool operator<(const Entry &other) const {
+        return mtime < other.mtime;
+      }
+    };
+    std::vector<Entry> entries;
+    unsigned long long total = 0;
+
+    for(int i = 0; i < 256; ++i) {
+      char sub[4];
+      snprintf(sub, sizeof(sub), "%02x", i);
+      std::string subdir = dir + "/" + sub;
+      DIR *dirp = opendir(subdir.c_str());
+      if(dirp == NULL) {
+        continue;
+      }
+      dirent *dp;
+      while((dp = readdir(dirp))) {
+        if(dp->d_name[0] == '.') {
+          continue;
+        }
+        Entry e;
+        e.path = subdir + "/" + dp->d_name;
+        struct stat st;
+        if(stat(e.path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+          continue;
+        }
+        e.mtime = st.st_mtime;
+        e.size = st.st_size;
+        total += e.size;
+        entries.push_back(e);
+      }
+      closedir(dirp);
+    }
+
+    if(total <= capacity) {
+      return total;
+    }
+    std::sort(entries.begin(), entries.end());
+    unsigned long long target = capacity / 10 * 9;
+    for(auto &e : entries) {
+      if(total <= target) {
+        break;
+      }
+      if(unlink(e.path.c_str()) == 0) {
+        total -= e.size;
+      }
+    }
+    return total;
+  }
+
+  std::string entry_path(uint64_t key) const {
+    char name[32];
+    snprintf(name, sizeof(name), "/%02x/%016llx", (unsigned int)(key >> 56), (unsigned long long)key);
+    return dir + name;
+  }
+
+  std::string dir;
+  unsigned long long capacity;
+  uint64_t parameterHash;
+  // Bytes of entries this process stored since the last trim().
+  mutable std::atomic<unsigned long long> added;
+  mutable std::mutex trimLock;
+};
+
+#endif /* HT_CACHE_HPP */
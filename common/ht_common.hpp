@@ -42,9 +42,27 @@ struct Arg: public option::Arg {
     }
     return option::ARG_ILLEGAL;
   }
+
+  // A count read into an unsigned, where a negative number would wrap
+  // around to billions.
+  static option::ArgStatus Count(const option::Option &opt, bool msg) {
+    char *endptr = 0;
+    long value = -1;
+    if(opt.arg != 0) {
+      value = strtol(opt.arg, &endptr, 10);
+    }
+    if(endptr != opt.arg && endptr != 0 && *endptr == 0 && value >= 0 && value <= 65535) {
+      return option::ARG_OK;
+    }
+
+    if(msg) {
+      printError("Option '", opt, "' requires a count from 0 to 65535\n");
+    }
+    return option::ARG_ILLEGAL;
+  }
 };
 
-enum optionIndex {UNKNOWN, HELP, POS_PATH, NEG_PATH, AUTO_TRAIN, SIZE_X, SIZE_Y};
+enum optionIndex {UNKNOWN, HELP, POS_PATH, NEG_PATH, AUTO_TRAIN, SIZE_X, SIZE_Y, THREADS, APPEND, CACHE_DIR, CACHE_SIZE, ORDER, PREFETCH, DTYPE, COMPRESS, SHARDS, MIRROR, WINDOWS, WINDOW_STRIDE, SEED, STATS_JSON, TRACE, SOLVER, LOSS, C_GRID, SEARCH_MEMORY, PASSES, CV, DETECTOR};
 
 static void saveCursor(void) {
   fwrite("\033[s", sizeof(char), 3, stderr);
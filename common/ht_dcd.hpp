@@ -0,0 +1,223 @@
+#ifndef HT_DCD_HPP
+#define HT_DCD_HPP
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <random>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+// A linear SVM solver (hog_trainer --solver dcd): dual coordinate descent as
+// in LIBLINEAR (Hsieh et al., "A Dual Coordinate Descent Method for
+// Large-scale Linear SVM", ICML 2008). It keeps the primal weights w up to
+// date while it updates one dual variable at a time, so every step costs one
+// dot product and one update over a single row, instead of the kernel
+// evaluations against every other example that CvSVM's SMO solver needs.
+// Training time grows about linearly with the number of examples.
+//
+// Rows are read where they are, as floats, out of the training matrix. The
+// bias is learned as the weight of an extra feature that is always 1 (so it
+// is regularized along with w, as in LIBLINEAR with -B 1). Examples whose
+// dual variables are stuck at a bound are shrunk out of the passes, and
+// checked again before stopping.
+
+enum DcdLoss {DCD_L1, DCD_L2};
+
+struct DcdParams {
+  DcdParams() : C(0.01), loss(DCD_L2), epsilon(0.1), maxPasses(1000), seed(1) {
+  }
+
+  double C;
+  DcdLoss loss;
+  // Stop when the projected gradients of all examples are within 'epsilon'
+  // of each other.
+  double epsilon;
+  int maxPasses;
+  uint64_t seed;
+};
+
+struct DcdResult {
+  int passes;
+  bool converged;
+  int supportVectors;
+};
+
+static inline bool parse_dcd_loss(const char *name, DcdLoss &into) {
+  if(strcmp(name, "l1") == 0) {
+    into = DCD_L1;
+  }
+  else if(strcmp(name, "l2") == 0) {
+    into = DCD_L2;
+  }
+  else {
+    return false;
+  }
+  return true;
+}
+
+// w.x + w[width], with four sums to keep the adds from waiting on each other.
+static inline double dcd_dot(const double *w, const float *x, int width) {
+  double s0 = 0.0, s1 = 0.0, s2 = 0.0, s3 = 0.0;
+  int k = 0;
+  for(; k + 4 <= width; k = k + 4) {
+    s0 = s0 + w[k] * x[k];
+    s1 = s1 + w[k + 1] * x[k + 1];
+    s2 = s2 + w[k + 2] * x[k + 2];
+    s3 = s3 + w[k + 3] * x[k + 3];
+  }
+  for(; k < width; ++k) {
+    s0 = s0 + w[k] * x[k];
+  }
+  return (s0 + s1) + (s2 + s3) + w[width];
+}
+
+// Train on the float rows 'rows' of 'features' with the +1/-1 'labels',
+// giving the decision function w.x + bias. With 'alpha', training starts
+// from its dual variables (one per row of 'rows', as left by an earlier run
+// on the same rows, usually with a smaller C) instead of from zero, and
+// leaves the new ones there; a solution for a nearby C is a good start.
+static inline DcdResult train_dcd(const cv::Mat &features, const cv::Mat &labels, const std::vector<int> &rows,
+                                  const DcdParams &params, std::vector<float> &w, double &bias,
+                                  std::vector<double> *alpha = NULL) {
+  const int count = rows.size();
+  const int width = features.cols;
+  const double diag = params.loss == DCD_L2 ? 0.5 / params.C : 0.0;
+  const double upper = params.loss == DCD_L2 ? HUGE_VAL : params.C;
+
+  std::vector<double> weights(width + 1, 0.0);
+  std::vector<double> own;
+  if(alpha == NULL) {
+    alpha = &own;
+  }
+  alpha->resize(count, 0.0);
+  std::vector<double> &a = *alpha;
+  std::vector<double> qd(count);
+  std::vector<signed char> y(count);
+  std::vector<int> index(count);
+  for(int i = 0; i < count; ++i) {
+    const float *x = features.ptr<float>(rows[i]);
+    double norm = 1.0;
+    for(int k = 0; k < width; ++k) {
+      norm = norm + (double)x[k] * x[k];
+    }
+    qd[i] = norm + diag;
+    y[i] = labels.at<float>(rows[i], 0) > 0 ? 1 : -1;
+    index[i] = i;
+    a[i] = std::min(std::max(a[i], 0.0), upper);
+    if(a[i] > 0.0) {
+      const double step = a[i] * y[i];
+      for(int k = 0; k < width; ++k) {
+        weights[k] = weights[k] + step * x[k];
+      }
+      weights[width] = weights[width] + step;
+    }
+  }
+
+  std::mt19937_64 random(params.seed);
+  double pgMaxOld = HUGE_VAL;
+  double pgMinOld = -HUGE_VAL;
+  int active = count;
+  DcdResult result;
+  result.converged = false;
+  for(result.passes = 0; result.passes < params.maxPasses; ) {
+    result.passes = result.passes + 1;
+    for(int s = 0; s < active; ++s) {
+      std::swap(index[s], index[s + random() % (active - s)]);
+    }
+
+    double pgMax = -HUGE_VAL;
+    double pgMin = HUGE_VAL;
+    for(int s = 0; s < active; ++s) {
+      const int i = index[s];
+      const float *x = features.ptr<float>(rows[i]);
+      const double g = y[i] * dcd_dot(weights.data(), x, width) - 1.0 + a[i] * diag;
+
+      // The projected gradient; examples at a bound that the gradient pushes
+      // further into it are shrunk:
+      double pg = g;
+      if(a[i] == 0.0) {
+        if(g > pgMaxOld) {
+          active = active - 1;
+          std::swap(index[s], index[active]);
+          s = s - 1;
+          continue;
+        }
+        pg = std::min(g, 0.0);
+      }
+      else if(a[i] == upper) {
+        if(g < pgMinOld) {
+          active = active - 1;
+          std::swap(index[s], index[active]);
+          s = s - 1;
+          continue;
+        }
+        pg = std::max(g, 0.0);
+      }
+      pgMax = std::max(pgMax, pg);
+      pgMin = std::min(pgMin, pg);
+
+      if(fabs(pg) > 1e-12) {
+        const double old = a[i];
+        a[i] = std::min(std::max(old - g / qd[i], 0.0), upper);
+        const double step = (a[i] - old) * y[i];
+        for(int k = 0; k < width; ++k) {
+          weights[k] = weights[k] + step * x[k];
+        }
+        weights[width] = weights[width] + step;
+      }
+    }
+
+    if(pgMax - pgMin <= params.epsilon) {
+      if(active == count) {
+        result.converged = true;
+        break;
+      }
+      // Converged on the active examples; make sure of the shrunk ones too.
+      active = count;
+      pgMaxOld = HUGE_VAL;
+      pgMinOld = -HUGE_VAL;
+      continue;
+    }
+    pgMaxOld = pgMax > 0.0 ? pgMax : HUGE_VAL;
+    pgMinOld = pgMin < 0.0 ? pgMin : -HUGE_VAL;
+  }
+
+  result.supportVectors = 0;
+  for(int i = 0; i < count; ++i) {
+    if(a[i] > 0.0) {
+      result.supportVectors = result.supportVectors + 1;
+    }
+  }
+  w.assign(weights.begin(), weights.end() - 1);
+  bias = weights[width];
+  return result;
+}
+
+// Train on every row of 'features'.
+static inline DcdResult train_dcd(const cv::Mat &features, const cv::Mat &labels, const DcdParams &params,
+                                  std::vector<float> &w, double &bias) {
+  std::vector<int> rows(features.rows);
+  for(int i = 0; i < features.rows; ++i) {
+    rows[i] = i;
+  }
+  return train_dcd(features, labels, rows, params, w, bias);
+}
+
+// The fraction of 'rows' that w.x + bias classifies correctly.
+static inline double linear_accuracy(const cv::Mat &features, const cv::Mat &labels, const std::vector<int> &rows,
+                                     const std::vector<float> &w, double bias) {
+  std::vector<double> weights(w.begin(), w.end());
+  weights.push_back(bias);
+  size_t correct = 0;
+  for(int r : rows) {
+    double score = dcd_dot(weights.data(), features.ptr<float>(r), features.cols);
+    if((score >= 0.0) == (labels.at<float>(r, 0) > 0)) {
+      correct = correct + 1;
+    }
+  }
+  return rows.empty() ? 0.0 : (double)correct / rows.size();
+}
+
+#endif /* HT_DCD_HPP */
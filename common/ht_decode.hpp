@@ -0,0 +1,262 @@
+#ifndef HT_DECODE_HPP
+#define HT_DECODE_HPP
+
+#include <stdio.h>
+#include <string.h>
+#include <setjmp.h>
+#include <memory>
+#include <string>
+#include <vector>
+#include <opencv2/opencv.hpp>
+#include <jpeglib.h>
+#include <png.h>
+
+// Decoding straight to a reduced size. Training windows are tiny (64x128 by
+// default) compared to camera images, so decoding every source pixel only to
+// throw most of them away in resize() dominates ingestion time and memory.
+// JPEGs are decoded with libjpeg's DCT scaling (1/2, 1/4 or 1/8), and
+// non-interlaced PNGs are streamed row by row through an area-averaging
+// reducer, in both cases to the smallest size that is still at least the
+// target size. Anything else goes through cv::imdecode at full size.
+
+static bool read_file_into(const char *path, std::vector<uchar> &into) {
+  FILE *f = fopen(path, "rb");
+  if(f == NULL) {
+    return false;
+  }
+  bool ok = fseek(f, 0, SEEK_END) == 0;
+  long length = ok ? ftell(f) : -1;
+  ok = length >= 0 && fseek(f, 0, SEEK_SET) == 0;
+  if(ok) {
+    into.resize(length);
+    ok = length == 0 || fread(into.data(), 1, length, f) == (size_t)length;
+  }
+  fclose(f);
+  return ok;
+}
+
+struct JpegErrorManager {
+  jpeg_error_mgr pub;
+  jmp_buf escape;
+};
+
+static void jpeg_error_escape(j_common_ptr cinfo) {
+  longjmp(((JpegErrorManager *)cinfo->err)->escape, 1);
+}
+
+static void jpeg_silence(j_common_ptr, int) {
+}
+
+static void jpeg_memory_init(j_decompress_ptr) {
+}
+
+static boolean jpeg_memory_fill(j_decompress_ptr cinfo) {
+  // Ran off the end of a truncated file; feed libjpeg an EOI marker.
+  static const JOCTET eoi[2] = {0xFF, JPEG_EOI};
+  cinfo->src->next_input_byte = eoi;
+  cinfo->src->bytes_in_buffer = 2;
+  return TRUE;
+}
+
+static void jpeg_memory_skip(j_decompress_ptr cinfo, long count) {
+  if(count > 0) {
+    if((size_t)count > cinfo->src->bytes_in_buffer) {
+      jpeg_memory_fill(cinfo);
+    }
+    else {
+      cinfo->src->next_input_byte += count;
+      cinfo->src->bytes_in_buffer -= count;
+    }
+  }
+}
+
+static void jpeg_memory_term(j_decompress_ptr) {
+}
+
+static bool decode_jpeg_reduced(const std::vector<uchar> &bytes, cv::Size target, cv::Mat &out) {
+  jpeg_decompress_struct cinfo;
+  JpegErrorManager jerr;
+  jpeg_source_mgr source;
+
+  cinfo.err = jpeg_std_error(&jerr.pub);
+  jerr.pub.error_exit = jpeg_error_escape;
+  jerr.pub.emit_message = jpeg_silence;
+  if(setjmp(jerr.escape)) {
+    jpeg_destroy_decompress(&cinfo);
+    return false;
+  }
+  jpeg_create_decompress(&cinfo);
+
+  source.next_input_byte = bytes.data();
+  source.bytes_in_buffer = bytes.size();
+  source.init_source = jpeg_memory_init;
+  source.fill_input_buffer = jpeg_memory_fill;
+  source.skip_input_data = jpeg_memory_skip;
+  source.resync_to_restart = jpeg_resync_to_restart;
+  source.term_source = jpeg_memory_term;
+  cinfo.src = &source;
+
+  jpeg_read_header(&cinfo, TRUE);
+  if(cinfo.jpeg_color_space != JCS_GRAYSCALE && cinfo.jpeg_color_space != JCS_YCbCr) {
+    // CMYK and friends: leave the color conversion to OpenCV.
+    jpeg_destroy_decompress(&cinfo);
+    return false;
+  }
+
+  // libjpeg rounds scaled dimensions up, so this never undershoots:
+  unsigned int denom = 8;
+  while(denom > 1 && ((cinfo.image_width + denom - 1)/denom < (unsigned int)target.width ||
+                      (cinfo.image_height + denom - 1)/denom < (unsigned int)target.height)) {
+    denom = denom / 2;
+  }
+  cinfo.scale_num = 1;
+  cinfo.scale_denom = denom;
+  cinfo.out_color_space = JCS_GRAYSCALE;
+  jpeg_start_decompress(&cinfo);
+
+  out.create(cinfo.output_height, cinfo.output_width, CV_8UC1);
+  while(cinfo.output_scanline < cinfo.output_height) {
+    JSAMPROW row = out.ptr<uchar>(cinfo.output_scanline);
+    jpeg_read_scanlines(&cinfo, &row, 1);
+  }
+  jpeg_finish_decompress(&cinfo);
+  jpeg_destroy_decompress(&cinfo);
+  return true;
+}
+
+struct PngMemoryReader {
+  const uchar *data;
+  size_t length;
+  size_t offset;
+};
+
+static void png_memory_read(png_structp png, png_bytep into, png_size_t count) {
+  PngMemoryReader *reader = (PngMemoryReader *)png_get_io_ptr(png);
+  if(reader->offset + count > reader->length) {
+    png_error(png, "truncated");
+  }
+  memcpy(into, reader->data + reader->offset, count);
+  reader->offset += count;
+}
+
+struct PngRowBuffers {
+  std::vector<uchar> row;
+  std::vector<unsigned int> sums;
+};
+
+static void png_silence(png_structp, png_const_charp) {
+}
+
+static bool decode_png_reduced(const std::vector<uchar> &bytes, cv::Size target, cv::Mat &out) {
+  png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, png_silence, png_silence);
+  if(png == NULL) {
+    return false;
+  }
+  png_infop info = png_create_info_struct(png);
+  // Row buffers live on the heap behind a pointer that is set before setjmp(),
+  // so they are still released properly after a longjmp():
+  std::unique_ptr<PngRowBuffers> buffers(new PngRowBuffers());
+  std::vector<uchar> &row = buffers->row;
+  std::vector<unsigned int> &sums = buffers->sums;
+  if(info == NULL || setjmp(png_jmpbuf(png))) {
+    png_destroy_read_struct(&png, &info, NULL);
+    return false;
+  }
+
+  PngMemoryReader reader = {bytes.data(), bytes.size(), 0};
+  png_set_read_fn(png, &reader, png_memory_read);
+  png_read_info(png, info);
+
+  png_uint_32 width = png_get_image_width(png, info);
+  png_uint_32 height = png_get_image_height(png, info);
+  int colorType = png_get_color_type(png, info);
+  if(png_get_interlace_type(png, info) != PNG_INTERLACE_NONE) {
+    // Interlaced rows arrive in several passes; can't stream those.
+    png_destroy_read_struct(&png, &info, NULL);
+    return false;
+  }
+
+  // Normalize everything to 8-bit gray, with OpenCV's luma weights:
+  png_set_strip_16(png);
+  png_set_strip_alpha(png);
+  if(colorType == PNG_COLOR_TYPE_PALETTE) {
+    png_set_palette_to_rgb(png);
+  }
+  if(colorType == PNG_COLOR_TYPE_GRAY && png_get_bit_depth(png, info) < 8) {
+    png_set_expand_gray_1_2_4_to_8(png);
+  }
+  if(colorType & PNG_COLOR_MASK_COLOR || colorType == PNG_COLOR_TYPE_PALETTE) {
+    png_set_rgb_to_gray_fixed(png, 1, 29900, 58700);
+  }
+  png_read_update_info(png, info);
+  if(png_get_channels(png, info) != 1 || png_get_bit_depth(png, info) != 8) {
+    png_destroy_read_struct(&png, &info, NULL);
+    return false;
+  }
+
+  // Area-average by the largest integer factor that keeps us at or above
+  // the target size. Output pixel x covers source columns
+  // [x*width/outWidth, (x+1)*width/outWidth), and likewise for rows.
+  png_uint_32 factor = 1;
+  if(target.width > 0 && target.height > 0) {
+    png_uint_32 fx = width / target.width, fy = height / target.height;
+    factor = fx < fy ? fx : fy;
+    factor = factor > 0 ? factor : 1;
+  }
+  png_uint_32 outWidth = width / factor, outHeight = height / factor;
+  out.create(outHeight, outWidth, CV_8UC1);
+  row.resize(png_get_rowbytes(png, info));
+  sums.assign(outWidth, 0);
+
+  png_uint_32 outRow = 0;
+  png_uint_32 rowsInSum = 0;
+  for(png_uint_32 y = 0; y < height; ++y) {
+    png_read_row(png, row.data(), NULL);
+    png_uint_32 x = 0;
+    for(png_uint_32 ox = 0; ox < outWidth; ++ox) {
+      png_uint_32 end = (unsigned long long)(ox + 1)*width/outWidth;
+      unsigned int sum = 0;
+      for(; x < end; ++x) {
+        sum += row[x];
+      }
+      sums[ox] += sum;
+    }
+    rowsInSum = rowsInSum + 1;
+
+    if(y + 1 == (unsigned long long)(outRow + 1)*height/outHeight) {
+      uchar *dst = out.ptr<uchar>(outRow);
+      for(png_uint_32 ox = 0; ox < outWidth; ++ox) {
+        png_uint_32 columns = (unsigned long long)(ox + 1)*width/outWidth - (unsigned long long)ox*width/outWidth;
+        unsigned int count = columns*rowsInSum;
+        dst[ox] = (uchar)((sums[ox] + count/2)/count);
+        sums[ox] = 0;
+      }
+      outRow = outRow + 1;
+      rowsInSum = 0;
+    }
+  }
+  png_read_end(png, NULL);
+  png_destroy_read_struct(&png, &info, NULL);
+  return true;
+}
+
+// Decode an encoded image to 8-bit grayscale, reducing it during decoding
+// as far as possible without going below 'target'. The result still needs a
+// final resize() to the exact target size. A target of INT_MAX x INT_MAX
+// decodes at full size.
+static cv::Mat decode_grayscale(const std::vector<uchar> &bytes, cv::Size target) {
+  cv::Mat image;
+  if(bytes.size() >= 3 && bytes[0] == 0xFF && bytes[1] == 0xD8 && bytes[2] == 0xFF) {
+    if(decode_jpeg_reduced(bytes, target, image)) {
+      return image;
+    }
+  }
+  else if(bytes.size() >= 8 && png_sig_cmp(bytes.data(), 0, 8) == 0) {
+    if(decode_png_reduced(bytes, target, image)) {
+      return image;
+    }
+  }
+  return cv::imdecode(cv::Mat(bytes), CV_LOAD_IMAGE_GRAYSCALE);
+}
+
+#endif /* HT_DECODE_HPP */
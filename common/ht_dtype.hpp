@@ -0,0 +1,265 @@
+#ifndef HT_DTYPE_HPP
+#define HT_DTYPE_HPP
+
+#include <stdint.h>
+#include <string.h>
+
+#include "ht_features.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HT_DTYPE_X86 1
+#include <immintrin.h>
+#endif
+
+// Reduced-precision storage for feature rows. HOG features are L2-Hys
+// clipped to [0, 0.2] before renormalization, so IEEE half precision (11
+// significant bits) keeps them to within about 1e-4, and bfloat16 (8
+// significant bits, float's exponent range) to within about 1e-3. Both
+// halve the size of a features file. Rows are narrowed when they are
+// written and widened back to float when they are loaded; both directions
+// round to nearest even, use F16C (half) or AVX2 (bfloat16) at runtime when
+// the CPU has them, and give bit-identical results either way.
+
+static inline bool parse_feature_type(const char *name, FeatureType &into) {
+  if(strcmp(name, "f32") == 0) {
+    into = FEATURE_F32;
+  }
+  else if(strcmp(name, "f16") == 0) {
+    into = FEATURE_F16;
+  }
+  else if(strcmp(name, "bf16") == 0) {
+    into = FEATURE_BF16;
+  }
+  else if(strcmp(name, "u8") == 0) {
+    into = FEATURE_U8;
+  }
+  else {
+    return false;
+  }
+  return true;
+}
+
+static inline const char *feature_type_name(uint32_t type) {
+  switch(type) {
+    case FEATURE_F32:
+    return "f32";
+    case FEATURE_F16:
+    return "f16";
+    case FEATURE_BF16:
+    return "bf16";
+    case FEATURE_U8:
+    return "u8";
+    default:
+    return "unknown";
+  }
+}
+
+static inline uint16_t float_to_half(float value) {
+  uint32_t f;
+  memcpy(&f, &value, sizeof(f));
+  uint32_t sign = (f >> 16) & 0x8000;
+  uint32_t exponent = (f >> 23) & 0xff;
+  uint32_t mantissa = f & 0x7fffff;
+
+  if(exponent == 0xff) {
+    // Infinity stays infinity, and NaNs keep their top payload bits but
+    // become quiet, as F16C does:
+    return sign | 0x7c00 | (mantissa != 0 ? 0x200 | (mantissa >> 13) : 0);
+  }
+  int e = (int)exponent - 127 + 15;
+  if(e >= 0x1f) {
+    return sign | 0x7c00;
+  }
+  if(e <= 0) {
+    // Subnormal half, or zero:
+    if(e < -10) {
+      return sign;
+    }
+    mantissa = mantissa | 0x800000;
+    uint32_t shift = 14 - e;
+    uint32_t half = mantissa >> shift;
+    uint32_t rest = mantissa & ((1u << shift) - 1);
+    uint32_t midpoint = 1u << (shift - 1);
+    if(rest > midpoint || (rest == midpoint && (half & 1))) {
+      half = half + 1;
+    }
+    return sign | half;
+  }
+  uint32_t half = ((uint32_t)e << 10) | (mantissa >> 13);
+  uint32_t rest = mantissa & 0x1fff;
+  // A carry out of the mantissa correctly bumps the exponent, up to infinity:
+  if(rest > 0x1000 || (rest == 0x1000 && (half & 1))) {
+    half = half + 1;
+  }
+  return sign | half;
+}
+
+static inline float half_to_float(uint16_t h) {
+  uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+  uint32_t exponent = (h >> 10) & 0x1f;
+  uint32_t mantissa = h & 0x3ff;
+  uint32_t f;
+  if(exponent == 0x1f) {
+    f = sign | 0x7f800000 | (mantissa << 13) | (mantissa != 0 ? 0x400000 : 0);
+  }
+  else if(exponent != 0) {
+    f = sign | ((exponent - 15 + 127) << 23) | (mantissa << 13);
+  }
+  else if(mantissa == 0) {
+    f = sign;
+  }
+  else {
+    // Subnormal half; normalize it:
+    exponent = 127 - 15 + 1;
+    while((mantissa & 0x400) == 0) {
+      mantissa = mantissa << 1;
+      exponent = exponent - 1;
+    }
+    f = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+  }
+  float value;
+  memcpy(&value, &f, sizeof(value));
+  return value;
+}
+
+static inline uint16_t float_to_bfloat16(float value) {
+  uint32_t f;
+  memcpy(&f, &value, sizeof(f));
+  if((f & 0x7fffffff) > 0x7f800000) {
+    return (f >> 16) | 0x40;
+  }
+  f = f + 0x7fff + ((f >> 16) & 1);
+  return f >> 16;
+}
+
+static inline float bfloat16_to_float(uint16_t b) {
+  uint32_t f = (uint32_t)b << 16;
+  float value;
+  memcpy(&value, &f, sizeof(value));
+  return value;
+}
+
+#ifdef HT_DTYPE_X86
+static inline bool dtype_has_f16c(void) {
+  static const bool has = (__builtin_cpu_init(), __builtin_cpu_supports("f16c") != 0);
+  return has;
+}
+
+static inline bool dtype_has_avx2(void) {
+  static const bool has = (__builtin_cpu_init(), __builtin_cpu_supports("avx2") != 0);
+  return has;
+}
+
+__attribute__((target("avx,f16c")))
+static inline size_t narrow_half_f16c(const float *in, size_t count, uint16_t *out) {
+  size_t i = 0;
+  for(; i + 8 <= count; i += 8) {
+    __m128i h = _mm256_cvtps_ph(_mm256_loadu_ps(in + i), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    _mm_storeu_si128((__m128i *)(out + i), h);
+  }
+  return i;
+}
+
+__attribute__((target("avx,f16c")))
+static inline size_t widen_half_f16c(const uint16_t *in, size_t count, float *out) {
+  size_t i = 0;
+  for(; i + 8 <= count; i += 8) {
+    _mm256_storeu_ps(out + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(in + i))));
+  }
+  return i;
+}
+
+__attribute__((target("avx2")))
+static inline size_t narrow_bfloat16_avx2(const float *in, size_t count, uint16_t *out) {
+  const __m256i bias = _mm256_set1_epi32(0x7fff);
+  const __m256i one = _mm256_set1_epi32(1);
+  const __m256i absMask = _mm256_set1_epi32(0x7fffffff);
+  const __m256i infinity = _mm256_set1_epi32(0x7f800000);
+  const __m256i quiet = _mm256_set1_epi32(0x400000);
+  size_t i = 0;
+  for(; i + 16 <= count; i += 16) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(in + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(in + i + 8));
+    __m256i nanA = _mm256_cmpgt_epi32(_mm256_and_si256(a, absMask), infinity);
+    __m256i nanB = _mm256_cmpgt_epi32(_mm256_and_si256(b, absMask), infinity);
+    __m256i roundedA = _mm256_add_epi32(a, _mm256_add_epi32(bias, _mm256_and_si256(_mm256_srli_epi32(a, 16), one)));
+    __m256i roundedB = _mm256_add_epi32(b, _mm256_add_epi32(bias, _mm256_and_si256(_mm256_srli_epi32(b, 16), one)));
+    a = _mm256_blendv_epi8(roundedA, _mm256_or_si256(a, quiet), nanA);
+    b = _mm256_blendv_epi8(roundedB, _mm256_or_si256(b, quiet), nanB);
+    // packus works within 128-bit lanes, so put the halves back in order:
+    __m256i packed = _mm256_packus_epi32(_mm256_srli_epi32(a, 16), _mm256_srli_epi32(b, 16));
+    packed = _mm256_permute4x64_epi64(packed, 0xd8);
+    _mm256_storeu_si256((__m256i *)(out + i), packed);
+  }
+  return i;
+}
+
+__attribute__((target("avx2")))
+static inline size_t widen_bfloat16_avx2(const uint16_t *in, size_t count, float *out) {
+  size_t i = 0;
+  for(; i + 8 <= count; i += 8) {
+    __m256i w = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(in + i)));
+    _mm256_storeu_si256((__m256i *)(out + i), _mm256_slli_epi32(w, 16));
+  }
+  return i;
+}
+#endif
+
+// Store 'count' floats as 'type' elements at 'out'. Quantized rows need their
+// scale table and go through ht_quantize.hpp instead.
+static inline void narrow_features(const float *in, size_t count, FeatureType type, void *out) {
+  if(type == FEATURE_F32) {
+    memcpy(out, in, count * sizeof(float));
+    return;
+  }
+  uint16_t *o = (uint16_t *)out;
+  size_t i = 0;
+#ifdef HT_DTYPE_X86
+  if(type == FEATURE_F16 && dtype_has_f16c()) {
+    i = narrow_half_f16c(in, count, o);
+  }
+  else if(type == FEATURE_BF16 && dtype_has_avx2()) {
+    i = narrow_bfloat16_avx2(in, count, o);
+  }
+#endif
+  for(; i < count; ++i) {
+    o[i] = type == FEATURE_F16 ? float_to_half(in[i]) : float_to_bfloat16(in[i]);
+  }
+}
+
+// Load 'count' 'type' elements at 'in' as floats.
+static inline void widen_features(const void *in, size_t count, FeatureType type, float *out) {
+  if(type == FEATURE_F32) {
+    memcpy(out, in, count * sizeof(float));
+    return;
+  }
+  const uint16_t *h = (const uint16_t *)in;
+  size_t i = 0;
+#ifdef HT_DTYPE_X86
+  if(type == FEATURE_F16 && dtype_has_f16c()) {
+    i = widen_half_f16c(h, count, out);
+  }
+  else if(type == FEATURE_BF16 && dtype_has_avx2()) {
+    i = widen_bfloat16_avx2(h, count, out);
+  }
+#endif
+  for(; i < count; ++i) {
+    out[i] = type == FEATURE_F16 ? half_to_float(h[i]) : bfloat16_to_float(h[i]);
+  }
+}
+
+// Rows that have been tombstoned by hog_snort --append start with NaN, or
+// have their flag byte set if they are quantized.
+static inline bool is_tombstoned_row(const void *row, const FeatureHeader &header) {
+  if(header.dtype == FEATURE_U8) {
+    return ((const uint8_t *)row)[header.width] != 0;
+  }
+  if(header.width == 0) {
+    return false;
+  }
+  float first;
+  widen_features(row, 1, (FeatureType)header.dtype, &first);
+  return first != first;
+}
+
+#endif /* HT_DTYPE_HPP */
@@ -0,0 +1,200 @@
+#ifndef HT_FEATURE_MAP_HPP
+#define HT_FEATURE_MAP_HPP
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+#include "ht_features.hpp"
+
+// Rows per block handed out for uncompressed files.
+static const uint64_t HT_FEATURE_MAP_BLOCK_ROWS = 4096;
+
+// How a features file will be read. Files read front to back, or all at
+// once, are read ahead in full as soon as they are opened. Files read a
+// block at a time in no particular order, more of them than fit in memory
+// (hog_trainer --solver sgd), aren't read ahead at all; their readers use
+// will_need_block() and release_block() instead.
+enum FeatureAccess {ACCESS_SEQUENTIAL, ACCESS_STREAMED};
+
+// A HOGSNRT features file mapped into memory read-only. Rows are used where
+// they lie in the page cache, without copying or converting anything; how
+// the kernel is told to read the file is up to open()'s FeatureAccess.
+//
+// Version 2 rows are 64-byte aligned and may hold half, bfloat16 or
+// quantized elements (see ht_dtype.hpp and ht_quantize.hpp). Version 1 rows
+// start at byte 15 of the file and are therefore unaligned, which x86
+// tolerates.
+//
+// Rows of compressed files can only be reached through block(), which
+// decompresses one block into a buffer of the caller's; separate threads can
+// do so at the same time with their own buffers. block() works on any file,
+// so readers that go block by block don't need to care.
+class MappedFeatures {
+public:
+  MappedFeatures() : base(NULL), length(0), index(NULL) {
+  }
+
+  ~MappedFeatures() {
+    close();
+  }
+
+  MappedFeatures(const MappedFeatures &) = delete;
+  MappedFeatures &operator=(const MappedFeatures &) = delete;
+
+  bool open(const std::string &path, const char **error, FeatureAccess access = ACCESS_SEQUENTIAL) {
+    close();
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+      *error = "couldn't open the file";
+      return false;
+    }
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size == 0) {
+      ::close(fd);
+      *error = "empty file";
+      return false;
+    }
+    length = st.st_size;
+    base = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if(base == MAP_FAILED) {
+      base = NULL;
+      *error = "couldn't map the file";
+      return false;
+    }
+    if(access == ACCESS_STREAMED) {
+      madvise(base, length, MADV_RANDOM);
+    }
+    else {
+      madvise(base, length, MADV_SEQUENTIAL);
+      madvise(base, length, MADV_WILLNEED);
+    }
+
+    if(!parse_feature_header((const char *)base, length, h, error)) {
+      close();
+      return false;
+    }
+    uint64_t end = h.dataOffset + h.rows * h.rowStride;
+    if(h.compression != COMPRESSION_NONE) {
+      end = h.indexOffset + feature_block_count(h) * sizeof(FeatureBlock);
+      index = (const FeatureBlock *)((const char *)base + h.indexOffset);
+    }
+    if(end > length) {
+      *error = "file is shorter than its header says";
+      close();
+      return false;
+    }
+    return true;
+  }
+
+  void close() {
+    if(base != NULL) {
+      munmap(base, length);
+      base = NULL;
+      length = 0;
+      index = NULL;
+    }
+  }
+
+  const FeatureHeader &header() const {
+    return h;
+  }
+
+  const char *data() const {
+    return (const char *)base;
+  }
+
+  bool compressed() const {
+    return h.compression != COMPRESSION_NONE;
+  }
+
+  uint64_t block_rows() const {
+    return compressed() ? h.blockRows : HT_FEATURE_MAP_BLOCK_ROWS;
+  }
+
+  uint64_t blocks() const {
+    return (h.rows + block_rows() - 1) / block_rows();
+  }
+
+  uint64_t block_first_row(uint64_t b) const {
+    return b * block_rows();
+  }
+
+  uint64_t block_row_count(uint64_t b) const {
+    return std::min(block_rows(), h.rows - block_first_row(b));
+  }
+
+  // The rows of block b, 'rowStride' bytes apart: either straight out of the
+  // mapping, or decompressed into 'scratch'. NULL if the block is corrupt.
+  const char *block(uint64_t b, std::vector<char> &scratch) const {
+    if(!compressed()) {
+      return (const char *)row(block_first_row(b));
+    }
+    const FeatureBlock &entry = index[b];
+    uLongf size = block_row_count(b) * h.rowStride;
+    if(entry.offset + entry.length > length) {
+      return NULL;
+    }
+    scratch.resize(size);
+    if(uncompress((Bytef *)scratch.data(), &size, (const Bytef *)base + entry.offset, entry.length) != Z_OK ||
+       size != scratch.size()) {
+      return NULL;
+    }
+    return scratch.data();
+  }
+
+  // Start reading block b in, before it is needed.
+  void will_need_block(uint64_t b) const {
+    advise_block(b, MADV_WILLNEED);
+  }
+
+  // Drop block b from this process's memory once it has been used; it stays
+  // in the page cache for as long as the kernel can spare it.
+  void release_block(uint64_t b) const {
+    advise_block(b, MADV_DONTNEED);
+  }
+
+  // Rows of uncompressed files only.
+  const void *row(uint64_t r) const {
+    return (const char *)base + h.dataOffset + r * h.rowStride;
+  }
+
+  // All rows of a float file as a rows x width matrix that points straight
+  // into the mapping. It must not outlive this object, and must not be
+  // written to.
+  cv::Mat matrix() const {
+    CV_Assert(h.dtype == FEATURE_F32 && !compressed());
+    return cv::Mat(h.rows, h.width, CV_32FC1, (void *)row(0), h.rowStride);
+  }
+
+private:
+  void advise_block(uint64_t b, int advice) const {
+    uint64_t start = h.dataOffset + block_first_row(b) * h.rowStride;
+    uint64_t size = block_row_count(b) * h.rowStride;
+    if(compressed()) {
+      start = index[b].offset;
+      size = index[b].length;
+    }
+    if(start + size > length) {
+      return;
+    }
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t from = ((uintptr_t)base + start) & ~(page - 1);
+    madvise((void *)from, (uintptr_t)base + start + size - from, advice);
+  }
+
+  FeatureHeader h;
+  void *base;
+  size_t length;
+  const FeatureBlock *index;
+};
+
+#endif /* HT_FEATURE_MAP_HPP */
@@ -0,0 +1,234 @@
+#ifndef HT_FEATURES_HPP
+#define HT_FEATURES_HPP
+
+#include <stdint.h>
+#include <string.h>
+#include <istream>
+#include <ostream>
+
+// HOGSNRT features files.
+//
+// Version 1 is a 7-byte "HOGSNRT" magic, a native-endian int row count and a
+// native-endian int row width, followed directly by the rows as floats.
+//
+// Version 2 starts with the fixed 128-byte header below. It records the
+// element type (float, half or bfloat16), the byte order it was written in
+// and the HOG parameters the features were computed with, and uses 64-bit
+// counts. The data starts at 'dataOffset' and every row takes 'rowStride'
+// bytes; both are multiples of 64, so rows can be used in place (mmap,
+// aligned SIMD loads). The bytes between the end of a row's elements and the
+// next row are zero. Files that are still being written carry the magic
+// "INVALID".
+//
+// Quantized (uint8) files also carry a table of 'width' float scales followed
+// by 'width' float offsets at 'tableOffset', between the header and the
+// data; element d of a row stands for offset[d] + scale[d] * q. Their rows
+// have one extra byte after the elements, which is nonzero for rows that
+// have been tombstoned (see ht_quantize.hpp).
+//
+// Compressed files group 'blockRows' rows into blocks, lay each block out
+// exactly as those rows would be in an uncompressed file, and compress each
+// one on its own with zlib. The blocks follow each other from 'dataOffset',
+// and an index of one FeatureBlock per block at 'indexOffset' tells where
+// each one is, so that any row can be found, and blocks decompressed in
+// parallel, without reading the others. Compressed files can't be changed in
+// place, so none of their rows are ever tombstoned.
+
+const char HOGSNRT_V1_MAGIC[7] = {'H', 'O', 'G', 'S', 'N', 'R', 'T'};
+const char HOGSNRT_V2_MAGIC[8] = {'H', 'O', 'G', 'S', 'N', 'R', '2', '\0'};
+const char HOGSNRT_INVALID_MAGIC[8] = {'I', 'N', 'V', 'A', 'L', 'I', 'D', '\0'};
+const uint32_t HOGSNRT_BYTE_ORDER = 0x01020304;
+const uint64_t HOGSNRT_ALIGNMENT = 64;
+
+enum FeatureType {FEATURE_F32 = 0, FEATURE_F16 = 1, FEATURE_BF16 = 2, FEATURE_U8 = 3};
+enum FeatureCompression {COMPRESSION_NONE = 0, COMPRESSION_ZLIB = 1};
+
+struct FeatureHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byteOrder;
+  uint32_t dtype;
+  uint32_t elementSize;
+  uint32_t windowWidth;
+  uint32_t windowHeight;
+  uint32_t cellSize;
+  uint32_t blockSize;
+  uint32_t blockStride;
+  uint32_t bins;
+  uint64_t rows;
+  uint64_t width;
+  uint64_t rowStride;
+  uint64_t dataOffset;
+  uint64_t tableOffset;
+  uint64_t compression;
+  uint64_t blockRows;
+  uint64_t indexOffset;
+  // Rows tombstoned by hog_snort --append, so that the live rows can be
+  // counted without reading them. Files written before this was kept have
+  // it at 0, and count their tombstoned rows as live.
+  uint64_t tombstoned;
+  uint64_t reserved[1];
+};
+
+static_assert(sizeof(FeatureHeader) == 128, "HOGSNRT v2 header must be 128 bytes");
+
+struct FeatureBlock {
+  uint64_t offset;
+  uint32_t length;
+  // Reserved; written as zero.
+  uint32_t reserved;
+};
+
+static_assert(sizeof(FeatureBlock) == 16, "HOGSNRT block index entries must be 16 bytes");
+
+static inline uint64_t feature_block_count(const FeatureHeader &header) {
+  if(header.compression == COMPRESSION_NONE || header.blockRows == 0) {
+    return 0;
+  }
+  return (header.rows + header.blockRows - 1) / header.blockRows;
+}
+
+// Bytes per element of a feature type, or 0 for an unknown one. Half and
+// bfloat16 rows are converted by common/ht_dtype.hpp, quantized ones by
+// common/ht_quantize.hpp.
+static inline uint32_t feature_type_size(uint32_t type) {
+  switch(type) {
+    case FEATURE_F32:
+    return 4;
+    case FEATURE_F16:
+    case FEATURE_BF16:
+    return 2;
+    case FEATURE_U8:
+    return 1;
+    default:
+    return 0;
+  }
+}
+
+static inline uint64_t align_feature_offset(uint64_t offset) {
+  return (offset + HOGSNRT_ALIGNMENT - 1) / HOGSNRT_ALIGNMENT * HOGSNRT_ALIGNMENT;
+}
+
+// A version 2 header for 'width'-element rows of HOG features computed over
+// 'windowWidth' x 'windowHeight' windows, stored as 'dtype' elements.
+static inline FeatureHeader make_feature_header(uint32_t windowWidth, uint32_t windowHeight,
+                                                uint32_t cellSize, uint32_t blockSize,
+                                                uint32_t blockStride, uint32_t bins,
+                                                uint64_t width, FeatureType dtype = FEATURE_F32) {
+  FeatureHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, HOGSNRT_V2_MAGIC, sizeof(h.magic));
+  h.version = 2;
+  h.byteOrder = HOGSNRT_BYTE_ORDER;
+  h.dtype = dtype;
+  h.elementSize = feature_type_size(dtype);
+  h.windowWidth = windowWidth;
+  h.windowHeight = windowHeight;
+  h.cellSize = cellSize;
+  h.blockSize = blockSize;
+  h.blockStride = blockStride;
+  h.bins = bins;
+  h.rows = 0;
+  h.width = width;
+  h.rowStride = align_feature_offset(width * h.elementSize);
+  h.dataOffset = align_feature_offset(sizeof(FeatureHeader));
+  if(dtype == FEATURE_U8) {
+    h.rowStride = align_feature_offset(width + 1);
+    h.tableOffset = h.dataOffset;
+    h.dataOffset = align_feature_offset(h.tableOffset + 2 * width * sizeof(float));
+  }
+  return h;
+}
+
+// Uncompressed bytes per block of a compressed file.
+const uint64_t HOGSNRT_BLOCK_BYTES = 1 << 20;
+
+static inline void set_feature_compression(FeatureHeader &h, FeatureCompression compression) {
+  h.compression = compression;
+  h.blockRows = 0;
+  if(compression != COMPRESSION_NONE) {
+    h.blockRows = h.rowStride > 0 && h.rowStride < HOGSNRT_BLOCK_BYTES ? HOGSNRT_BLOCK_BYTES / h.rowStride : 1;
+  }
+}
+
+static inline void write_feature_header(const FeatureHeader &header, bool valid, std::ostream &f) {
+  FeatureHeader h = header;
+  if(!valid) {
+    memcpy(h.magic, HOGSNRT_INVALID_MAGIC, sizeof(h.magic));
+  }
+  f.seekp(0);
+  f.write((const char *)&h, sizeof(h));
+}
+
+// Parse a version 1 or version 2 header from the first 'length' bytes of a
+// file. Version 1 headers are converted: their data starts right after the
+// header, rows are packed floats, and the HOG parameters are unknown (zero).
+static inline bool parse_feature_header(const char *data, size_t length, FeatureHeader &into, const char **error) {
+  if(length >= sizeof(HOGSNRT_V1_MAGIC) && memcmp(data, HOGSNRT_V1_MAGIC, sizeof(HOGSNRT_V1_MAGIC)) == 0) {
+    int counts[2];
+    if(length < sizeof(HOGSNRT_V1_MAGIC) + sizeof(counts)) {
+      *error = "truncated header";
+      return false;
+    }
+    memcpy(counts, data + sizeof(HOGSNRT_V1_MAGIC), sizeof(counts));
+    if(counts[0] < 0 || counts[1] < 0) {
+      *error = "negative counts";
+      return false;
+    }
+    memset(&into, 0, sizeof(into));
+    memcpy(into.magic, HOGSNRT_V1_MAGIC, sizeof(HOGSNRT_V1_MAGIC));
+    into.version = 1;
+    into.byteOrder = HOGSNRT_BYTE_ORDER;
+    into.dtype = FEATURE_F32;
+    into.elementSize = sizeof(float);
+    into.rows = counts[0];
+    into.width = counts[1];
+    into.rowStride = into.width * sizeof(float);
+    into.dataOffset = sizeof(HOGSNRT_V1_MAGIC) + sizeof(counts);
+    return true;
+  }
+
+  if(length < sizeof(HOGSNRT_V2_MAGIC) || memcmp(data, HOGSNRT_V2_MAGIC, sizeof(HOGSNRT_V2_MAGIC)) != 0) {
+    *error = "not a HOGSNRT file, or an incomplete one";
+    return false;
+  }
+  if(length < sizeof(into)) {
+    *error = "truncated header";
+    return false;
+  }
+  memcpy(&into, data, sizeof(into));
+  if(into.byteOrder != HOGSNRT_BYTE_ORDER) {
+    *error = "written on a machine with a different byte order";
+    return false;
+  }
+  if(into.version != 2 || into.elementSize == 0 || into.elementSize != feature_type_size(into.dtype)) {
+    *error = "unsupported version or element type";
+    return false;
+  }
+  uint64_t rowBytes = into.width * into.elementSize + (into.dtype == FEATURE_U8 ? 1 : 0);
+  if(into.rowStride < rowBytes || into.dataOffset < sizeof(into)) {
+    *error = "inconsistent row layout";
+    return false;
+  }
+  if(into.dtype == FEATURE_U8 && (into.tableOffset < sizeof(into) ||
+                                  into.tableOffset + 2 * into.width * sizeof(float) > into.dataOffset)) {
+    *error = "inconsistent scale table";
+    return false;
+  }
+  if(into.compression > COMPRESSION_ZLIB || (into.compression != COMPRESSION_NONE && into.blockRows == 0)) {
+    *error = "unsupported compression";
+    return false;
+  }
+  return true;
+}
+
+static inline bool read_feature_header(std::istream &f, FeatureHeader &into, const char **error) {
+  char data[sizeof(FeatureHeader)];
+  f.seekg(0);
+  f.read(data, sizeof(data));
+  size_t length = f.gcount();
+  f.clear();
+  return parse_feature_header(data, length, into, error);
+}
+
+#endif /* HT_FEATURES_HPP */
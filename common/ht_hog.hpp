@@ -0,0 +1,717 @@
+#ifndef HT_HOG_HPP
+#define HT_HOG_HPP
+
+#include <float.h>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HT_HOG_X86 1
+#include <immintrin.h>
+#endif
+
+// An in-tree HOG implementation for the one configuration the HOG Trainer
+// uses: square blocks of BlockCells x BlockCells cells, a block stride of one
+// cell, Bins unsigned orientation bins, a Gaussian block window, L2-Hys
+// normalization and no gamma correction. It follows
+// cv::HOGDescriptor::compute() step for step ([-1 0 1] gradients with
+// reflected borders, votes split between the two nearest orientation bins,
+// bilinear voting into the cells of each block, L2-Hys per block) and lays out
+// the descriptor the same way (blocks column by column, cells column by column
+// within a block, then bins).
+//
+// Tolerance: against OpenCV 4.11 every element of a descriptor is within 5e-4
+// absolute of cv::HOGDescriptor::compute() (mean difference around 2e-5),
+// from float summation order and the atan2 approximation. Parity with the
+// OpenCV 2.x this suite builds against has not been measured; 2.x uses a
+// coarser atan2 (about 0.3 degrees), so its differences will be larger, by an
+// unverified amount.
+//
+// Gradients are turned into one plane per orientation bin, so that voting is a
+// set of dense multiply-adds against precomputed separable per-cell weights
+// instead of a scatter. Only a ring of BlockSize rows of those planes is kept,
+// so memory use doesn't grow with the image height. The gradient, voting and
+// normalization loops have scalar, SSE2 and AVX2 versions picked at runtime.
+
+enum HogIsa {HOG_SCALAR, HOG_SSE2, HOG_AVX2};
+
+static HogIsa hog_detect_isa(void) {
+#ifdef HT_HOG_X86
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2")) {
+    return HOG_AVX2;
+  }
+  if(__builtin_cpu_supports("sse2")) {
+    return HOG_SSE2;
+  }
+#endif
+  return HOG_SCALAR;
+}
+
+static const char *hog_isa_name(HogIsa isa) {
+  switch(isa) {
+    case HOG_AVX2:
+    return "AVX2";
+    case HOG_SSE2:
+    return "SSE2";
+    default:
+    return "scalar";
+  }
+}
+
+// atan(t) for t in [0, 1], within 1e-5 radians (Abramowitz & Stegun 4.4.49).
+// Every ISA uses the same polynomial so that they all bin identically.
+#define HOG_ATAN_C1 0.9998660f
+#define HOG_ATAN_C3 -0.3302995f
+#define HOG_ATAN_C5 0.1801410f
+#define HOG_ATAN_C7 -0.0851330f
+#define HOG_ATAN_C9 0.0208351f
+
+template<int Bins>
+static inline void hog_vote_scalar(float dx, float dy, int &b0, float &w0, float &w1) {
+  const float angleScale = (float)(Bins / CV_PI);
+  float mag = sqrtf(dx*dx + dy*dy);
+  float ax = fabsf(dx), ay = fabsf(dy);
+  float mn = ax < ay ? ax : ay;
+  float mx = ax < ay ? ay : ax;
+  float t = mn / (mx > FLT_MIN ? mx : FLT_MIN);
+  float t2 = t*t;
+  float a = t*(HOG_ATAN_C1 + t2*(HOG_ATAN_C3 + t2*(HOG_ATAN_C5 + t2*(HOG_ATAN_C7 + t2*HOG_ATAN_C9))));
+  if(ay > ax) {
+    a = (float)(CV_PI / 2) - a;
+  }
+  if((dx < 0) != (dy < 0)) {
+    a = (float)CV_PI - a;
+  }
+
+  float angle = a*angleScale - 0.5f;
+  int hidx = (int)angle;
+  if((float)hidx > angle) {
+    hidx = hidx - 1;
+  }
+  angle -= hidx;
+  w0 = mag*(1.f - angle);
+  w1 = mag*angle;
+  if(hidx < 0) {
+    hidx += Bins;
+  }
+  else if(hidx >= Bins) {
+    hidx -= Bins;
+  }
+  b0 = hidx;
+}
+
+template<int Bins>
+static inline void hog_planes_scalar(float dx, float dy, float *planes, size_t planeStride) {
+  int b0;
+  float w0, w1;
+  hog_vote_scalar<Bins>(dx, dy, b0, w0, w1);
+  int b1 = b0 + 1 < Bins ? b0 + 1 : 0;
+  for(int b = 0; b < Bins; ++b) {
+    planes[b*planeStride] = (b == b0 ? w0 : 0.f) + (b == b1 ? w1 : 0.f);
+  }
+}
+
+// Compute one row of orientation planes from the rows above and below it.
+template<int Bins>
+static void hog_gradient_row_scalar(const uchar *prev, const uchar *cur, const uchar *next,
+                                    int width, float *planes, size_t planeStride) {
+  for(int x = 0; x < width; ++x) {
+    int xl = x > 0 ? x - 1 : 1;
+    int xr = x < width - 1 ? x + 1 : width - 2;
+    float dx = (float)cur[xr] - (float)cur[xl];
+    float dy = (float)next[x] - (float)prev[x];
+    hog_planes_scalar<Bins>(dx, dy, planes + x, planeStride);
+  }
+}
+
+#ifdef HT_HOG_X86
+static inline __m128 hog_load4_sse2(const uchar *p) {
+  int32_t v;
+  memcpy(&v, p, 4);
+  __m128i b = _mm_cvtsi32_si128(v);
+  b = _mm_unpacklo_epi8(b, _mm_setzero_si128());
+  b = _mm_unpacklo_epi16(b, _mm_setzero_si128());
+  return _mm_cvtepi32_ps(b);
+}
+
+__attribute__((target("avx2")))
+static inline __m256 hog_load8_avx2(const uchar *p) {
+  return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)p)));
+}
+
+template<int Bins>
+static void hog_gradient_row_sse2(const uchar *prev, const uchar *cur, const uchar *next,
+                                  int width, float *planes, size_t planeStride) {
+  const __m128 angleScale = _mm_set1_ps((float)(Bins / CV_PI));
+  const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+  const __m128 zero = _mm_setzero_ps();
+  const __m128i zeroi = _mm_setzero_si128();
+  const __m128i bins = _mm_set1_epi32(Bins);
+  const __m128i one = _mm_set1_epi32(1);
+
+  hog_planes_scalar<Bins>((float)cur[1] - (float)cur[1], (float)next[0] - (float)prev[0], planes, planeStride);
+  int x = 1;
+  for(; x + 4 <= width - 1; x += 4) {
+    __m128 dx = _mm_sub_ps(hog_load4_sse2(cur + x + 1), hog_load4_sse2(cur + x - 1));
+    __m128 dy = _mm_sub_ps(hog_load4_sse2(next + x), hog_load4_sse2(prev + x));
+    __m128 mag = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)));
+    __m128 ax = _mm_and_ps(dx, absMask), ay = _mm_and_ps(dy, absMask);
+    __m128 mn = _mm_min_ps(ax, ay), mx = _mm_max_ps(ax, ay);
+    __m128 t = _mm_div_ps(mn, _mm_max_ps(mx, _mm_set1_ps(FLT_MIN)));
+    __m128 t2 = _mm_mul_ps(t, t);
+    __m128 a = _mm_add_ps(_mm_set1_ps(HOG_ATAN_C7), _mm_mul_ps(t2, _mm_set1_ps(HOG_ATAN_C9)));
+    a = _mm_add_ps(_mm_set1_ps(HOG_ATAN_C5), _mm_mul_ps(t2, a));
+    a = _mm_add_ps(_mm_set1_ps(HOG_ATAN_C3), _mm_mul_ps(t2, a));
+    a = _mm_add_ps(_mm_set1_ps(HOG_ATAN_C1), _mm_mul_ps(t2, a));
+    a = _mm_mul_ps(t, a);
+    __m128 steep = _mm_cmpgt_ps(ay, ax);
+    a = _mm_or_ps(_mm_and_ps(steep, _mm_sub_ps(_mm_set1_ps((float)(CV_PI / 2)), a)), _mm_andnot_ps(steep, a));
+    __m128 flip = _mm_xor_ps(_mm_cmplt_ps(dx, zero), _mm_cmplt_ps(dy, zero));
+    a = _mm_or_ps(_mm_and_ps(flip, _mm_sub_ps(_mm_set1_ps((float)CV_PI), a)), _mm_andnot_ps(flip, a));
+
+    __m128 angle = _mm_sub_ps(_mm_mul_ps(a, angleScale), _mm_set1_ps(0.5f));
+    __m128i hidx = _mm_cvttps_epi32(angle);
+    __m128 fidx = _mm_cvtepi32_ps(hidx);
+    __m128i below = _mm_castps_si128(_mm_cmpgt_ps(fidx, angle));
+    hidx = _mm_add_epi32(hidx, below); // floor(): subtract 1 where truncation rounded up
+    angle = _mm_sub_ps(angle, _mm_cvtepi32_ps(hidx));
+    __m128 w0 = _mm_mul_ps(mag, _mm_sub_ps(_mm_set1_ps(1.f), angle));
+    __m128 w1 = _mm_mul_ps(mag, angle);
+    hidx = _mm_add_epi32(hidx, _mm_and_si128(_mm_cmplt_epi32(hidx, zeroi), bins));
+    hidx = _mm_sub_epi32(hidx, _mm_andnot_si128(_mm_cmplt_epi32(hidx, bins), bins));
+    __m128i b1 = _mm_add_epi32(hidx, one);
+    b1 = _mm_and_si128(b1, _mm_cmplt_epi32(b1, bins));
+
+    for(int b = 0; b < Bins; ++b) {
+      __m128i bv = _mm_set1_epi32(b);
+      __m128 v0 = _mm_and_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(hidx, bv)), w0);
+      __m128 v1 = _mm_and_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(b1, bv)), w1);
+      _mm_storeu_ps(planes + b*planeStride + x, _mm_add_ps(v0, v1));
+    }
+  }
+  for(; x < width; ++x) {
+    int xr = x < width - 1 ? x + 1 : width - 2;
+    float dx = (float)cur[xr] - (float)cur[x - 1];
+    float dy = (float)next[x] - (float)prev[x];
+    hog_planes_scalar<Bins>(dx, dy, planes + x, planeStride);
+  }
+}
+
+template<int Bins>
+__attribute__((target("avx2")))
+static void hog_gradient_row_avx2(const uchar *prev, const uchar *cur, const uchar *next,
+                                  int width, float *planes, size_t planeStride) {
+  const __m256 angleScale = _mm256_set1_ps((float)(Bins / CV_PI));
+  const __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256i zeroi = _mm256_setzero_si256();
+  const __m256i bins = _mm256_set1_epi32(Bins);
+  const __m256i binsMinusOne = _mm256_set1_epi32(Bins - 1);
+  const __m256i one = _mm256_set1_epi32(1);
+
+  hog_planes_scalar<Bins>((float)cur[1] - (float)cur[1], (float)next[0] - (float)prev[0], planes, planeStride);
+  int x = 1;
+  for(; x + 8 <= width - 1; x += 8) {
+    __m256 dx = _mm256_sub_ps(hog_load8_avx2(cur + x + 1), hog_load8_avx2(cur + x - 1));
+    __m256 dy = _mm256_sub_ps(hog_load8_avx2(next + x), hog_load8_avx2(prev + x));
+    __m256 mag = _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)));
+    __m256 ax = _mm256_and_ps(dx, absMask), ay = _mm256_and_ps(dy, absMask);
+    __m256 mn = _mm256_min_ps(ax, ay), mx = _mm256_max_ps(ax, ay);
+    __m256 t = _mm256_div_ps(mn, _mm256_max_ps(mx, _mm256_set1_ps(FLT_MIN)));
+    __m256 t2 = _mm256_mul_ps(t, t);
+    __m256 a = _mm256_add_ps(_mm256_set1_ps(HOG_ATAN_C7), _mm256_mul_ps(t2, _mm256_set1_ps(HOG_ATAN_C9)));
+    a = _mm256_add_ps(_mm256_set1_ps(HOG_ATAN_C5), _mm256_mul_ps(t2, a));
+    a = _mm256_add_ps(_mm256_set1_ps(HOG_ATAN_C3), _mm256_mul_ps(t2, a));
+    a = _mm256_add_ps(_mm256_set1_ps(HOG_ATAN_C1), _mm256_mul_ps(t2, a));
+    a = _mm256_mul_ps(t, a);
+    a = _mm256_blendv_ps(a, _mm256_sub_ps(_mm256_set1_ps((float)(CV_PI / 2)), a), _mm256_cmp_ps(ay, ax, _CMP_GT_OQ));
+    __m256 flip = _mm256_xor_ps(_mm256_cmp_ps(dx, zero, _CMP_LT_OQ), _mm256_cmp_ps(dy, zero, _CMP_LT_OQ));
+    a = _mm256_blendv_ps(a, _mm256_sub_ps(_mm256_set1_ps((float)CV_PI), a), flip);
+
+    __m256 angle = _mm256_sub_ps(_mm256_mul_ps(a, angleScale), _mm256_set1_ps(0.5f));
+    __m256 fidx = _mm256_floor_ps(angle);
+    __m256i hidx = _mm256_cvttps_epi32(fidx);
+    angle = _mm256_sub_ps(angle, fidx);
+    __m256 w0 = _mm256_mul_ps(mag, _mm256_sub_ps(_mm256_set1_ps(1.f), angle));
+    __m256 w1 = _mm256_mul_ps(mag, angle);
+    hidx = _mm256_add_epi32(hidx, _mm256_and_si256(_mm256_cmpgt_epi32(zeroi, hidx), bins));
+    hidx = _mm256_sub_epi32(hidx, _mm256_and_si256(_mm256_cmpgt_epi32(hidx, binsMinusOne), bins));
+    __m256i b1 = _mm256_add_epi32(hidx, one);
+    b1 = _mm256_andnot_si256(_mm256_cmpgt_epi32(b1, binsMinusOne), b1);
+
+    for(int b = 0; b < Bins; ++b) {
+      __m256i bv = _mm256_set1_epi32(b);
+      __m256 v0 = _mm256_and_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(hidx, bv)), w0);
+      __m256 v1 = _mm256_and_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(b1, bv)), w1);
+      _mm256_storeu_ps(planes + b*planeStride + x, _mm256_add_ps(v0, v1));
+    }
+  }
+  for(; x < width; ++x) {
+    int xr = x < width - 1 ? x + 1 : width - 2;
+    float dx = (float)cur[xr] - (float)cur[x - 1];
+    float dy = (float)next[x] - (float)prev[x];
+    hog_planes_scalar<Bins>(dx, dy, planes + x, planeStride);
+  }
+}
+#endif
+
+// L2-Hys: L2-normalize, clip at 0.2, then L2-normalize again.
+static void hog_normalize_scalar(float *hist, int size) {
+  float sum = 0;
+  for(int i = 0; i < size; ++i) {
+    sum += hist[i]*hist[i];
+  }
+  float scale = 1.f/(sqrtf(sum) + size*0.1f);
+  sum = 0;
+  for(int i = 0; i < size; ++i) {
+    hist[i] = hist[i]*scale < 0.2f ? hist[i]*scale : 0.2f;
+    sum += hist[i]*hist[i];
+  }
+  scale = 1.f/(sqrtf(sum) + 1e-3f);
+  for(int i = 0; i < size; ++i) {
+    hist[i] *= scale;
+  }
+}
+
+#ifdef HT_HOG_X86
+static float hog_hsum_sse2(__m128 v) {
+  __m128 s = _mm_add_ps(v, _mm_movehl_ps(v, v));
+  s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+  return _mm_cvtss_f32(s);
+}
+
+static void hog_normalize_sse2(float *hist, int size) {
+  const __m128 thresh = _mm_set1_ps(0.2f);
+  int n = size & ~3;
+  __m128 acc = _mm_setzero_ps();
+  for(int i = 0; i < n; i += 4) {
+    __m128 h = _mm_loadu_ps(hist + i);
+    acc = _mm_add_ps(acc, _mm_mul_ps(h, h));
+  }
+  float sum = hog_hsum_sse2(acc);
+  for(int i = n; i < size; ++i) {
+    sum += hist[i]*hist[i];
+  }
+  float scale = 1.f/(sqrtf(sum) + size*0.1f);
+  __m128 vscale = _mm_set1_ps(scale);
+  acc = _mm_setzero_ps();
+  for(int i = 0; i < n; i += 4) {
+    __m128 h = _mm_min_ps(_mm_mul_ps(_mm_loadu_ps(hist + i), vscale), thresh);
+    _mm_storeu_ps(hist + i, h);
+    acc = _mm_add_ps(acc, _mm_mul_ps(h, h));
+  }
+  sum = hog_hsum_sse2(acc);
+  for(int i = n; i < size; ++i) {
+    hist[i] = hist[i]*scale < 0.2f ? hist[i]*scale : 0.2f;
+    sum += hist[i]*hist[i];
+  }
+  scale = 1.f/(sqrtf(sum) + 1e-3f);
+  vscale = _mm_set1_ps(scale);
+  for(int i = 0; i < n; i += 4) {
+    _mm_storeu_ps(hist + i, _mm_mul_ps(_mm_loadu_ps(hist + i), vscale));
+  }
+  for(int i = n; i < size; ++i) {
+    hist[i] *= scale;
+  }
+}
+
+__attribute__((target("avx2")))
+static float hog_hsum_avx2(__m256 v) {
+  __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+  s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+  s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+  return _mm_cvtss_f32(s);
+}
+
+__attribute__((target("avx2")))
+static void hog_normalize_avx2(float *hist, int size) {
+  const __m256 thresh = _mm256_set1_ps(0.2f);
+  int n = size & ~7;
+  __m256 acc = _mm256_setzero_ps();
+  for(int i = 0; i < n; i += 8) {
+    __m256 h = _mm256_loadu_ps(hist + i);
+    acc = _mm256_add_ps(acc, _mm256_mul_ps(h, h));
+  }
+  float sum = hog_hsum_avx2(acc);
+  for(int i = n; i < size; ++i) {
+    sum += hist[i]*hist[i];
+  }
+  float scale = 1.f/(sqrtf(sum) + size*0.1f);
+  __m256 vscale = _mm256_set1_ps(scale);
+  acc = _mm256_setzero_ps();
+  for(int i = 0; i < n; i += 8) {
+    __m256 h = _mm256_min_ps(_mm256_mul_ps(_mm256_loadu_ps(hist + i), vscale), thresh);
+    _mm256_storeu_ps(hist + i, h);
+    acc = _mm256_add_ps(acc, _mm256_mul_ps(h, h));
+  }
+  sum = hog_hsum_avx2(acc);
+  for(int i = n; i < size; ++i) {
+    hist[i] = hist[i]*scale < 0.2f ? hist[i]*scale : 0.2f;
+    sum += hist[i]*hist[i];
+  }
+  scale = 1.f/(sqrtf(sum) + 1e-3f);
+  vscale = _mm256_set1_ps(scale);
+  for(int i = 0; i < n; i += 8) {
+    _mm256_storeu_ps(hist + i, _mm256_mul_ps(_mm256_loadu_ps(hist + i), vscale));
+  }
+  for(int i = n; i < size; ++i) {
+    hist[i] *= scale;
+  }
+}
+#endif
+
+template<int CellSize, int BlockCells, int Bins>
+class HogKernel {
+public:
+  enum {
+    BlockSize = CellSize*BlockCells,
+    BlockStride = CellSize,
+    Cells = BlockCells*BlockCells,
+    BlockHistogramSize = Cells*Bins
+  };
+
+  HogKernel() : isa(hog_detect_isa()) {
+    // Each pixel's vote for a cell is weighted by the Gaussian block window
+    // (sigma = BlockSize/4, as in OpenCV) times its bilinear weight for that
+    // cell; cells outside the block get no vote. Both factors are separable,
+    // so keep one 1-D weight per cell row/column and block coordinate.
+    float sigma = (BlockSize + BlockSize) / 8.f;
+    float scale = 1.f/(sigma*sigma*2);
+    for(int c = 0; c < BlockCells; ++c) {
+      cellStart[c] = BlockSize;
+      cellEnd[c] = 0;
+    }
+    for(int p = 0; p < BlockSize; ++p) {
+      float d = p - BlockSize*0.5f;
+      float gauss = expf(-d*d*scale);
+      float cell = (p + 0.5f)/CellSize - 0.5f;
+      int icell = cvFloor(cell);
+      cell -= icell;
+      for(int c = 0; c < BlockCells; ++c) {
+        float w = c == icell ? 1.f - cell : (c == icell + 1 ? cell : 0.f);
+        weights[c][p] = gauss*w;
+        if(w != 0.f) {
+          cellStart[c] = p < cellStart[c] ? p : cellStart[c];
+          cellEnd[c] = p + 1;
+        }
+      }
+    }
+  }
+
+  HogIsa get_isa() const {
+    return isa;
+  }
+
+  // Whether a window (or image) size tiles evenly into blocks.
+  static bool supports(cv::Size size) {
+    return size.width >= BlockSize && size.height >= BlockSize &&
+           (size.width - BlockSize) % BlockStride == 0 &&
+           (size.height - BlockSize) % BlockStride == 0;
+  }
+
+  static cv::Size block_grid(cv::Size size) {
+    return cv::Size((size.width - BlockSize)/BlockStride + 1,
+                    (size.height - BlockSize)/BlockStride + 1);
+  }
+
+  static size_t descriptor_size(cv::Size window) {
+    return (size_t)block_grid(window).area()*BlockHistogramSize;
+  }
+
+  // Compute the normalized histogram of every block in an 8-bit grayscale
+  // image whose size supports() accepts. Blocks are stored column by column,
+  // which for an image the size of the detection window is exactly the HOG
+  // descriptor.
+  void compute(const cv::Mat &image, std::vector<float> &out) {
+    CV_Assert(image.type() == CV_8UC1 && supports(image.size()));
+    const int width = image.cols;
+    const cv::Size grid = block_grid(image.size());
+    const size_t planeStride = (size_t)BlockSize*width;
+    out.resize((size_t)grid.area()*BlockHistogramSize);
+    ring.resize(planeStride*Bins);
+
+    int nextRow = 0;
+    for(int by = 0; by < grid.height; ++by) {
+      int y0 = by*BlockStride;
+      for(; nextRow < y0 + BlockSize; ++nextRow) {
+        gradient_row(image, nextRow, planeStride);
+      }
+      for(int bx = 0; bx < grid.width; ++bx) {
+        float *hist = out.data() + ((size_t)bx*grid.height + by)*BlockHistogramSize;
+        accumulate_block(bx*BlockStride, y0, width, planeStride, hist);
+        normalize(hist);
+      }
+    }
+  }
+
+private:
+  void gradient_row(const cv::Mat &image, int y, size_t planeStride) {
+    const int width = image.cols, height = image.rows;
+    const uchar *prev = image.ptr<uchar>(y > 0 ? y - 1 : 1);
+    const uchar *cur = image.ptr<uchar>(y);
+    const uchar *next = image.ptr<uchar>(y < height - 1 ? y + 1 : height - 2);
+    float *planes = ring.data() + (size_t)(y % BlockSize)*width;
+#ifdef HT_HOG_X86
+    if(isa == HOG_AVX2) {
+      hog_gradient_row_avx2<Bins>(prev, cur, next, width, planes, planeStride);
+      return;
+    }
+    if(isa == HOG_SSE2) {
+      hog_gradient_row_sse2<Bins>(prev, cur, next, width, planes, planeStride);
+      return;
+    }
+#endif
+    hog_gradient_row_scalar<Bins>(prev, cur, next, width, planes, planeStride);
+  }
+
+  void accumulate_block(int x0, int y0, int width, size_t planeStride, float *hist) {
+    for(int py = 0; py < BlockSize; ++py) {
+      rowOffset[py] = (size_t)((y0 + py) % BlockSize)*width + x0;
+    }
+#ifdef HT_HOG_X86
+    if(isa == HOG_AVX2 && BlockSize % 8 == 0) {
+      accumulate_block_avx2(x0, y0, width, planeStride, hist);
+      return;
+    }
+    if(isa == HOG_SSE2 && BlockSize % 4 == 0) {
+      accumulate_block_sse2(x0, y0, width, planeStride, hist);
+      return;
+    }
+#endif
+    // For each cell row, sum the plane rows weighted by that row's vertical
+    // weights, then dot the sums with each cell column's horizontal weights.
+    for(int b = 0; b < Bins; ++b) {
+      const float *plane = ring.data() + b*planeStride;
+      for(int cy = 0; cy < BlockCells; ++cy) {
+        float sums[BlockSize] = {0};
+        for(int py = cellStart[cy]; py < cellEnd[cy]; ++py) {
+          const float *row = plane + rowOffset[py];
+          for(int px = 0; px < BlockSize; ++px) {
+            sums[px] += row[px]*weights[cy][py];
+          }
+        }
+        for(int cx = 0; cx < BlockCells; ++cx) {
+          float sum = 0;
+          for(int px = cellStart[cx]; px < cellEnd[cx]; ++px) {
+            sum += sums[px]*weights[cx][px];
+          }
+          hist[(cx*BlockCells + cy)*Bins + b] = sum;
+        }
+      }
+    }
+  }
+
+#ifdef HT_HOG_X86
+  void accumulate_block_sse2(int x0, int y0, int width, size_t planeStride, float *hist) {
+    const int Lanes = BlockSize/4 > 0 ? BlockSize/4 : 1;
+    for(int b = 0; b < Bins; ++b) {
+      const float *plane = ring.data() + b*planeStride;
+      for(int cy = 0; cy < BlockCells; ++cy) {
+        __m128 sums[Lanes];
+        for(int k = 0; k < Lanes; ++k) {
+          sums[k] = _mm_setzero_ps();
+        }
+        for(int py = cellStart[cy]; py < cellEnd[cy]; ++py) {
+          const float *row = plane + rowOffset[py];
+          __m128 w = _mm_set1_ps(weights[cy][py]);
+          for(int k = 0; k < Lanes; ++k) {
+            sums[k] = _mm_add_ps(sums[k], _mm_mul_ps(_mm_loadu_ps(row + k*4), w));
+          }
+        }
+        for(int cx = 0; cx < BlockCells; ++cx) {
+          __m128 acc = _mm_setzero_ps();
+          for(int k = 0; k < Lanes; ++k) {
+            acc = _mm_add_ps(acc, _mm_mul_ps(sums[k], _mm_loadu_ps(&weights[cx][k*4])));
+          }
+          hist[(cx*BlockCells + cy)*Bins + b] = hog_hsum_sse2(acc);
+        }
+      }
+    }
+  }
+
+  __attribute__((target("avx2")))
+  void accumulate_block_avx2(int x0, int y0, int width, size_t planeStride, float *hist) {
+    const int Lanes = BlockSize/8 > 0 ? BlockSize/8 : 1;
+    for(int b = 0; b < Bins; ++b) {
+      const float *plane = ring.data() + b*planeStride;
+      for(int cy = 0; cy < BlockCells; ++cy) {
+        __m256 sums[Lanes];
+        for(int k = 0; k < Lanes; ++k) {
+          sums[k] = _mm256_setzero_ps();
+        }
+        for(int py = cellStart[cy]; py < cellEnd[cy]; ++py) {
+          const float *row = plane + rowOffset[py];
+          __m256 w = _mm256_set1_ps(weights[cy][py]);
+          for(int k = 0; k < Lanes; ++k) {
+            sums[k] = _mm256_add_ps(sums[k], _mm256_mul_ps(_mm256_loadu_ps(row + k*8), w));
+          }
+        }
+        for(int cx = 0; cx < BlockCells; ++cx) {
+          __m256 acc = _mm256_setzero_ps();
+          for(int k = 0; k < Lanes; ++k) {
+            acc = _mm256_add_ps(acc, _mm256_mul_ps(sums[k], _mm256_loadu_ps(&weights[cx][k*8])));
+          }
+          hist[(cx*BlockCells + cy)*Bins + b] = hog_hsum_avx2(acc);
+        }
+      }
+    }
+  }
+#endif
+
+  void normalize(float *hist) {
+#ifdef HT_HOG_X86
+    if(isa == HOG_AVX2) {
+      hog_normalize_avx2(hist, BlockHistogramSize);
+      return;
+    }
+    if(isa == HOG_SSE2) {
+      hog_normalize_sse2(hist, BlockHistogramSize);
+      return;
+    }
+#endif
+    hog_normalize_scalar(hist, BlockHistogramSize);
+  }
+
+  HogIsa isa;
+  float weights[BlockCells][BlockSize];
+  int cellStart[BlockCells];
+  int cellEnd[BlockCells];
+  size_t rowOffset[BlockSize];
+  std::vector<float> ring;
+};
+
+// The HOG layout used throughout the HOG Trainer: 16x16 blocks of 8x8 cells,
+// an 8x8 block stride and 9 orientation bins.
+typedef HogKernel<8, 2, 9> TrainerHogKernel;
+
+// Computes descriptors for one window size, with the in-tree kernel when the
+// window tiles evenly into blocks and with cv::HOGDescriptor otherwise. Keep
+// one per thread; it holds scratch space.
+class HogExtractor {
+public:
+  // The HOG Trainer's fixed descriptor layout:
+  enum {
+    CellSize = 8,
+    BlockSize = 16,
+    BlockStride = 8,
+    Bins = 9
+  };
+  static_assert((int)TrainerHogKernel::BlockSize == (int)BlockSize &&
+                (int)TrainerHogKernel::BlockStride == (int)BlockStride &&
+                (int)TrainerHogKernel::BlockHistogramSize == 4 * Bins,
+                "TrainerHogKernel must match HogExtractor's layout");
+
+  HogExtractor(cv::Size window)
+      : window(window),
+        native(TrainerHogKernel::supports(window)),
+        hog(window, cv::Size(BlockSize, BlockSize), cv::Size(BlockStride, BlockStride),
+            cv::Size(CellSize, CellSize), Bins) {
+  }
+
+  void compute(const cv::Mat &image, std::vector<float> &out) {
+    if(native) {
+      kernel.compute(image, out);
+    }
+    else {
+      std::vector<cv::Point> l;
+      hog.compute(image, out, cv::Size(0,0), cv::Size(0,0), l);
+    }
+  }
+
+  // The normalized histograms of every block of a whole image, column by
+  // column, for windows that tile evenly into blocks (see ht_windows.hpp).
+  void compute_blocks(const cv::Mat &image, std::vector<float> &out) {
+    CV_Assert(native);
+    kernel.compute(image, out);
+  }
+
+  size_t descriptor_size() const {
+    return native ? TrainerHogKernel::descriptor_size(window) : hog.getDescriptorSize();
+  }
+
+  const char *implementation() const {
+    return native ? hog_isa_name(kernel.get_isa()) : "OpenCV";
+  }
+
+  // Everything besides the image that determines the descriptor; the ISA
+  // paths of the in-tree kernel agree to within rounding, so they share one.
+  std::string signature() const {
+    std::ostringstream s;
+    s << "HOG window=" << window.width << "x" << window.height
+      << " block=" << (int)BlockSize << " stride=" << (int)BlockStride
+      << " cell=" << (int)CellSize << " bins=" << (int)Bins
+      << " impl=" << (native ? "native-1" : "OpenCV");
+    return s.str();
+  }
+
+private:
+  cv::Size window;
+  bool native;
+  TrainerHogKernel kernel;
+  cv::HOGDescriptor hog;
+};
+
+// Turns the descriptor of a window into the descriptor of the same window
+// mirrored left to right, without going back to the pixels. Mirroring sends
+// block column bx to nbx - 1 - bx, cell column cx within a block to
+// BlockCells - 1 - cx, and a gradient at angle t to one at pi - t, which with
+// bins centred on (b + 0.5) * pi / Bins is bin Bins - 1 - b; rows of blocks
+// and cells stay where they are. So the mirrored descriptor is a fixed
+// permutation of the original, worked out once per window size.
+//
+// Tolerance: the permutation itself is exact (with a symmetric block window
+// it agrees with computing the flipped image to within 5e-7), but the block
+// window's Gaussian is centred half a pixel right of the middle of the
+// block, as in OpenCV, so the mirrored pixels are weighted slightly
+// differently. Against the descriptor of the flipped image, elements differ
+// by about 0.015 on average and at most about 0.07 (elements average 0.15).
+// Windows that don't tile evenly into blocks aren't mirror-symmetric at all
+// and aren't supported.
+class HogMirror {
+public:
+  HogMirror(cv::Size window) {
+    if(!TrainerHogKernel::supports(window)) {
+      return;
+    }
+    const cv::Size grid = TrainerHogKernel::block_grid(window);
+    const int blockCells = HogExtractor::BlockSize / HogExtractor::CellSize;
+    const int bins = HogExtractor::Bins;
+    table.resize(TrainerHogKernel::descriptor_size(window));
+    for(int bx = 0; bx < grid.width; ++bx) {
+      for(int by = 0; by < grid.height; ++by) {
+        for(int cx = 0; cx < blockCells; ++cx) {
+          for(int cy = 0; cy < blockCells; ++cy) {
+            for(int b = 0; b < bins; ++b) {
+              size_t to = (((size_t)bx*grid.height + by)*blockCells*blockCells + cx*blockCells + cy)*bins + b;
+              size_t from = (((size_t)(grid.width - 1 - bx)*grid.height + by)*blockCells*blockCells +
+                             (blockCells - 1 - cx)*blockCells + cy)*bins + (bins - 1 - b);
+              table[to] = (uint32_t)from;
+            }
+          }
+        }
+      }
+    }
+  }
+
+  bool supported() const {
+    return !table.empty();
+  }
+
+  // Mirror one descriptor at 'in' into 'out'.
+  void apply(const float *in, float *out) const {
+    for(size_t i = 0; i < table.size(); ++i) {
+      out[i] = in[table[i]];
+    }
+  }
+
+private:
+  std::vector<uint32_t> table;
+};
+
+#endif /* HT_HOG_HPP */
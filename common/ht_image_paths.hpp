@@ -2,62 +2,243 @@
 #define HT_IMAGE_PATHS_HPP
 
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
-static bool is_valid_file_extension(std::string ext) {
-  auto e = ext.c_str();
-  if(strcmp("bmp", e) == 0) {
-    return true;
+// A compact list of paths. Every path is stored NUL-terminated in one shared
+// character arena, so millions of paths cost two allocations instead of one
+// (or more) per path. Pointers returned by operator[] are invalidated by
+// add() and append().
+class PathList {
+public:
+  size_t size() const {
+    return offsets.size();
   }
-  else if(strcmp("jpg", e) == 0) {
-    return true;
+
+  bool empty() const {
+    return offsets.empty();
   }
-  else if(strcmp("jpeg", e) == 0) {
-    return true;
+
+  const char *operator[](size_t i) const {
+    return chars.data() + offsets[i];
   }
-  else if(strcmp("png", e) == 0) {
-    return true;
+
+  void add(const char *path) {
+    offsets.push_back(chars.size());
+    chars.insert(chars.end(), path, path + strlen(path) + 1);
   }
-  else if(strcmp("ppm", e) == 0) {
-    return true;
+
+  // Add "<dir>/<name>" without building it in a temporary first.
+  void add(const char *dir, size_t dirLength, const char *name) {
+    offsets.push_back(chars.size());
+    chars.insert(chars.end(), dir, dir + dirLength);
+    chars.push_back('/');
+    chars.insert(chars.end(), name, name + strlen(name) + 1);
   }
-  else if(strcmp("pgm", e) == 0) {
-    return true;
+
+  void append(const PathList &other) {
+    size_t base = chars.size();
+    chars.insert(chars.end(), other.chars.begin(), other.chars.end());
+    for(auto offset : other.offsets) {
+      offsets.push_back(base + offset);
+    }
+  }
+
+  // Sort by path (bytewise), and lay the arena out in that order.
+  void sort() {
+    const char *base = chars.data();
+    std::sort(offsets.begin(), offsets.end(), [base](size_t a, size_t b) {
+      return strcmp(base + a, base + b) < 0;
+    });
+    std::vector<char> sorted;
+    sorted.reserve(chars.size());
+    for(auto &offset : offsets) {
+      const char *path = base + offset;
+      offset = sorted.size();
+      sorted.insert(sorted.end(), path, path + strlen(path) + 1);
+    }
+    chars.swap(sorted);
+  }
+
+  void clear() {
+    chars.clear();
+    offsets.clear();
+  }
+
+private:
+  std::vector<char> chars;
+  std::vector<size_t> offsets;
+};
+
+static bool is_valid_file_extension(const char *filename) {
+  static const char *const extensions[] = {"bmp", "jpg", "jpeg", "png", "ppm", "pgm"};
+  const char *dot = strrchr(filename, '.');
+  if(dot == NULL) {
+    return false;
+  }
+  for(auto ext : extensions) {
+    if(strcasecmp(dot + 1, ext) == 0) {
+      return true;
+    }
   }
   return false;
 }
 
-static bool get_image_paths_into(std::string dir, std::vector<std::string>& into) {
-  auto dirp = opendir(dir.c_str());
-  if(dirp != NULL) {
-    dirent *dp;
-    while((dp = readdir(dirp))) {
-      auto filename = std::string(dp->d_name);
-      auto ext_pos = std::string(dp->d_name).find_last_of('.');
-      auto ext = filename.substr(ext_pos + 1);
-      // Convert extension to lowercase:
-      std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
-
-      if(dp->d_type & DT_DIR) {
-        continue; // Skip directories
-      }
-      else if(!is_valid_file_extension(ext)) {
-        fprintf(stderr, "Skipping %s...\n", dp->d_name);
+// Listing directories and looking files up is bound by filesystem latency
+// (especially over NFS) rather than CPU, so it gets more workers than cores.
+static const unsigned int HT_LOOKUP_THREADS = 16;
+
+// The record layout returned by getdents64(2).
+struct LinuxDirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[1];
+};
+
+// Shared state for a parallel directory walk: a queue of directories still
+// to be scanned, and the number of workers currently scanning one.
+struct DirectoryWalk {
+  std::mutex lock;
+  std::condition_variable wake;
+  std::deque<std::string> pending;
+  unsigned int busy;
+};
+
+// Scan one directory with large getdents64 reads, adding its images to
+// 'into' and its subdirectories to 'subdirs'.
+static void scan_directory(const std::string &dir, std::vector<uint64_t> &buffer,
+                           PathList &into, std::vector<std::string> &subdirs,
+                           size_t &skipped) {
+  int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if(fd < 0) {
+    fprintf(stderr, "Couldn't open directory '%s', skipping...\n", dir.c_str());
+    return;
+  }
+
+  for(;;) {
+    long length = syscall(SYS_getdents64, fd, buffer.data(), buffer.size() * sizeof(uint64_t));
+    if(length <= 0) {
+      break;
+    }
+    const char *records = (const char *)buffer.data();
+    for(long offset = 0; offset < length;) {
+      const LinuxDirent64 *d = (const LinuxDirent64 *)(records + offset);
+      offset += d->d_reclen;
+      const char *name = d->d_name;
+      if(name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
         continue;
       }
-      auto imagePath = std::string(dir);
-      imagePath += "/";
-      imagePath += filename;
-      into.push_back(imagePath);
+
+      unsigned char type = d->d_type;
+      if(type == DT_UNKNOWN) {
+        // Some filesystems don't report entry types; ask for it:
+        struct stat st;
+        if(fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+          continue;
+        }
+        type = S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+      }
+
+      if(type == DT_DIR) {
+        subdirs.push_back(dir + "/" + name);
+      }
+      else if(is_valid_file_extension(name)) {
+        into.add(dir.data(), dir.size(), name);
+      }
+      else {
+        skipped = skipped + 1;
+      }
+    }
+  }
+  close(fd);
+}
+
+static void walk_directories(DirectoryWalk &walk, PathList &into, size_t &skipped) {
+  std::vector<uint64_t> buffer((1 << 20) / sizeof(uint64_t));
+  std::vector<std::string> subdirs;
+  for(;;) {
+    std::string dir;
+    {
+      std::unique_lock<std::mutex> guard(walk.lock);
+      while(walk.pending.empty() && walk.busy > 0) {
+        walk.wake.wait(guard);
+      }
+      if(walk.pending.empty()) {
+        return; // Nothing queued and nobody left to queue anything.
+      }
+      dir.swap(walk.pending.front());
+      walk.pending.pop_front();
+      walk.busy = walk.busy + 1;
+    }
+
+    scan_directory(dir, buffer, into, subdirs, skipped);
+
+    bool notify;
+    {
+      std::lock_guard<std::mutex> guard(walk.lock);
+      for(auto &s : subdirs) {
+        walk.pending.push_back(std::move(s));
+      }
+      walk.busy = walk.busy - 1;
+      notify = !subdirs.empty() || walk.busy == 0;
+    }
+    subdirs.clear();
+    if(notify) {
+      walk.wake.notify_all();
     }
-    closedir(dirp);
-    return true;
   }
-  else {
+}
+
+// Recursively collect the images under 'root' into 'into', sorted by path.
+// Subdirectories are scanned by a pool of workers. 'skipped' counts
+// non-image files.
+static bool get_image_paths_into(std::string root, PathList &into, size_t &skipped,
+                                 unsigned int workers = HT_LOOKUP_THREADS) {
+  while(root.size() > 1 && root.back() == '/') {
+    root.pop_back();
+  }
+  int fd = open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if(fd < 0) {
     return false;
   }
+  close(fd);
+
+  DirectoryWalk walk;
+  walk.busy = 0;
+  walk.pending.push_back(root);
+
+  std::vector<PathList> found(workers);
+  std::vector<size_t> skips(workers, 0);
+  std::vector<std::thread> pool;
+  for(unsigned int w = 0; w < workers; ++w) {
+    pool.push_back(std::thread(walk_directories, std::ref(walk), std::ref(found[w]), std::ref(skips[w])));
+  }
+  for(auto &t : pool) {
+    t.join();
+  }
+
+  skipped = 0;
+  for(unsigned int w = 0; w < workers; ++w) {
+    into.append(found[w]);
+    skipped += skips[w];
+  }
+  into.sort();
+  return true;
 }
 
 #endif /* HT_IMAGE_PATHS_HPP */
@@ -0,0 +1,801 @@
+#ifndef HT_IMAGE_SOURCE_HPP
+#define HT_IMAGE_SOURCE_HPP
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <opencv2/opencv.hpp>
+#include <zlib.h>
+
+#include "ht_decode.hpp"
+#include "ht_image_paths.hpp"
+#include "ht_io_order.hpp"
+
+// Where the images come from: a directory tree, or a tar or zip archive that
+// is read in place, without extracting anything. Every source has a table of
+// named entries; read() hands back an entry's encoded bytes, ready for
+// decode_grayscale(). read() and will_need() may be called from any thread.
+class ImageSource {
+public:
+  virtual ~ImageSource() {
+  }
+
+  size_t size() const {
+    return names.size();
+  }
+
+  const char *name(size_t i) const {
+    return names[i];
+  }
+
+  // Size and modification time, used to spot changed images.
+  virtual bool stat(size_t i, unsigned long long &size, long long &mtime) const = 0;
+
+  virtual bool read(size_t i, std::vector<uchar> &into) const = 0;
+
+  // Ask the kernel to start reading entry i.
+  virtual void will_need(size_t i) const = 0;
+
+  // Put 'indices' in the order in which to read them.
+  virtual void order(std::vector<size_t> &indices, PathOrder order) const = 0;
+
+protected:
+  PathList names;
+};
+
+class DirectorySource : public ImageSource {
+public:
+  bool open(const std::string &dir, size_t &skipped) {
+    return get_image_paths_into(dir, names, skipped);
+  }
+
+  bool stat(size_t i, unsigned long long &size, long long &mtime) const {
+    struct stat st;
+    if(::stat(names[i], &st) != 0) {
+      return false;
+    }
+    size = st.st_size;
+    mtime = st.st_mtime;
+    return true;
+  }
+
+  bool read(size_t i, std::vector<uchar> &into) const {
+    return read_file_into(names[i], into);
+  }
+
+  void will_need(size_t i) const {
+    int fd = ::open(names[i], O_RDONLY | O_CLOEXEC);
+    if(fd >= 0) {
+      posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+      close(fd);
+    }
+  }
+
+  void order(std::vector<size_t> &indices, PathOrder order) const {
+    path_order(names, indices, order, HT_LOOKUP_THREADS);
+  }
+};
+
+// Read 'length' bytes at 'offset' of 'fd', however many reads that takes.
+static bool read_fully(int fd, unsigned long long offset, void *into, size_t length) {
+  char *p = (char *)into;
+  while(length > 0) {
+    ssize_t n = pread(fd, p, length, offset);
+    if(n <= 0) {
+      return false;
+    }
+    p += n;
+    offset += n;
+    length -= n;
+  }
+  return true;
+}
+
+// Whether an archive member is an image, going by its extension.
+static bool is_image_member(const std::string &memberName) {
+  const char *slash = strrchr(memberName.c_str(), '/');
+  return is_valid_file_extension(slash ? slash + 1 : memberName.c_str());
+}
+
+// Archives can hold several members of the same name (a tar archive that
+// was appended to, say), and every image needs a name of its own in the
+// manifest, so the second and later ones are renamed "<name>#2" and so on.
+class MemberNames {
+public:
+  std::string unique(const std::string &memberName) {
+    unsigned int &seen = seenNames[memberName];
+    seen = seen + 1;
+    if(seen == 1) {
+      return memberName;
+    }
+    std::string name = memberName + "#" + std::to_string(seen);
+    fprintf(stderr, "The archive has more than one member named '%s'; calling copy %u '%s'.\n",
+            memberName.c_str(), seen, name.c_str());
+    return name;
+  }
+
+private:
+  std::unordered_map<std::string, unsigned int> seenNames;
+};
+
+// The member headers of a POSIX (ustar/pax) or GNU tar archive, uncompressed,
+// read through a file descriptor it doesn't own. TarSource uses it to index
+// an archive, and TarStream to read one straight through.
+class TarReader {
+public:
+  // A regular file member: its name, where its data starts, and its size.
+  struct Member {
+    std::string name;
+    unsigned long long offset;
+    unsigned long long size;
+    long long mtime;
+  };
+
+  TarReader() : fd(-1) {
+  }
+
+  void attach(int archiveFd, const std::string &path) {
+    fd = archiveFd;
+    archivePath = path;
+  }
+
+  static bool has_valid_header(const unsigned char *block) {
+    unsigned int stored = parse_number(block + 148, 8);
+    unsigned int sum = 0;
+    for(int i = 0; i < 512; ++i) {
+      sum += (i >= 148 && i < 156) ? ' ' : block[i];
+    }
+    return sum == stored;
+  }
+
+  // Find the next regular file member at or after 'offset', and move
+  // 'offset' past it. Returns false at the end of the archive.
+  bool next(unsigned long long &offset, Member &m) const {
+    unsigned char header[512];
+    std::string longName;
+    std::string paxName;
+    unsigned long long paxSize = 0;
+    bool havePaxSize = false;
+    while(read_fully(fd, offset, header, 512)) {
+      if(header[0] == '\0') {
+        return false; // End of archive
+      }
+      if(!has_valid_header(header)) {
+        fprintf(stderr, "Corrupt tar header in '%s', ignoring the rest of the archive...\n", archivePath.c_str());
+        return false;
+      }
+      unsigned long long size = parse_number(header + 124, 12);
+      char type = header[156];
+      unsigned long long data = offset + 512;
+      offset = data + (size + 511) / 512 * 512;
+
+      if(type == 'L') {
+        // GNU long name for the next member:
+        std::vector<char> name(size + 1, '\0');
+        if(!read_fully(fd, data, name.data(), size)) {
+          return false;
+        }
+        longName = name.data();
+        continue;
+      }
+      if(type == 'x') {
+        // pax extended header for the next member:
+        std::vector<char> records(size + 1, '\0');
+        if(!read_fully(fd, data, records.data(), size)) {
+          return false;
+        }
+        parse_pax(records.data(), size, paxName, paxSize, havePaxSize);
+        continue;
+      }
+
+      if(havePaxSize) {
+        size = paxSize;
+        offset = data + (size + 511) / 512 * 512;
+      }
+      if(!paxName.empty()) {
+        m.name = paxName;
+      }
+      else if(!longName.empty()) {
+        m.name = longName;
+      }
+      else {
+        m.name = field(header + 345, 155);
+        if(!m.name.empty()) {
+          m.name += "/";
+        }
+        m.name += field(header, 100);
+      }
+      longName.clear();
+      paxName.clear();
+      havePaxSize = false;
+
+      if(type != '0' && type != '\0' && type != '7') {
+        continue; // Directories, links and other special members
+      }
+      m.offset = data;
+      m.size = size;
+      m.mtime = parse_number(header + 136, 12);
+      return true;
+    }
+    return false;
+  }
+
+private:
+  static std::string field(const unsigned char *p, size_t length) {
+    return std::string((const char *)p, strnlen((const char *)p, length));
+  }
+
+  // Octal, or GNU base-256 for values that don't fit.
+  static unsigned long long parse_number(const unsigned char *p, size_t length) {
+    unsigned long long value = 0;
+    if(p[0] & 0x80) {
+      value = p[0] & 0x3F;
+      for(size_t i = 1; i < length; ++i) {
+        value = (value << 8) | p[i];
+      }
+      return value;
+    }
+    size_t i = 0;
+    while(i < length && (p[i] == ' ' || p[i] == '\0')) {
+      i = i + 1;
+    }
+    for(; i < length && p[i] >= '0' && p[i] <= '7'; ++i) {
+      value = value * 8 + (p[i] - '0');
+    }
+    return value;
+  }
+
+  // Records are "<length> <key>=<value>\n".
+  static void parse_pax(const char *records, size_t length, std::string &path,
+                        unsigned long long &size, bool &haveSize) {
+    size_t pos = 0;
+    while(pos < length) {
+      char *end;
+      unsigned long recordLength = strtoul(records + pos, &end, 10);
+      if(recordLength == 0 || pos + recordLength > length || *end != ' ') {
+        return;
+      }
+      const char *key = end + 1;
+      const char *equals = (const char *)memchr(key, '=', records + pos + recordLength - key);
+      if(equals != NULL) {
+        std::string value(equals + 1, records + pos + recordLength - 1 - (equals + 1));
+        if(equals - key == 4 && strncmp(key, "path", 4) == 0) {
+          path = value;
+        }
+        else if(equals - key == 4 && strncmp(key, "size", 4) == 0) {
+          size = strtoull(value.c_str(), NULL, 10);
+          haveSize = true;
+        }
+      }
+      pos += recordLength;
+    }
+  }
+
+  int fd;
+  std::string archivePath;
+};
+
+// Common ground for archives: one open file, and an entry table holding
+// where each member's data starts. Members are kept in archive order, which
+// is also their order on disk, so reading them in index order streams
+// through the archive front to back.
+class ArchiveSource : public ImageSource {
+public:
+  ArchiveSource() : fd(-1) {
+  }
+
+  ~ArchiveSource() {
+    if(fd >= 0) {
+      close(fd);
+    }
+  }
+
+  bool stat(size_t i, unsigned long long &size, long long &mtime) const {
+    size = entries[i].size;
+    mtime = entries[i].mtime;
+    return true;
+  }
+
+  void will_need(size_t i) const {
+    posix_fadvise(fd, entries[i].offset, entries[i].storedSize, POSIX_FADV_WILLNEED);
+  }
+
+  void order(std::vector<size_t> &indices, PathOrder) const {
+    // Archive order already is on-disk order.
+    std::sort(indices.begin(), indices.end());
+  }
+
+protected:
+  struct Entry {
+    unsigned long long offset;     // Member data (tar) or local header (zip)
+    unsigned long long storedSize; // Bytes in the archive
+    unsigned long long size;       // Bytes once extracted
+    long long mtime;
+    uint32_t crc;
+    int method;
+  };
+
+  bool open_file(const std::string &path) {
+    fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    return fd >= 0;
+  }
+
+  bool read_at(unsigned long long offset, void *into, size_t length) const {
+    return read_fully(fd, offset, into, length);
+  }
+
+  void add_entry(const std::string &memberName, const Entry &e, size_t &skipped) {
+    if(!is_image_member(memberName)) {
+      skipped = skipped + 1;
+      return;
+    }
+    names.add(memberNames.unique(memberName).c_str());
+    entries.push_back(e);
+  }
+
+  int fd;
+  std::vector<Entry> entries;
+  MemberNames memberNames;
+};
+
+// POSIX (ustar/pax) and GNU tar archives, uncompressed.
+class TarSource : public ArchiveSource {
+public:
+  // Index every member up front, which reads the header of every member
+  // before the first image can be read; TarStream lists the members as it
+  // reads through the archive instead.
+  bool open(const std::string &path, size_t &skipped) {
+    if(!open_file(path)) {
+      return false;
+    }
+    // Only the headers are needed now; don't read ahead into member data.
+    posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+    TarReader reader;
+    reader.attach(fd, path);
+    unsigned long long offset = 0;
+    TarReader::Member m;
+    while(reader.next(offset, m)) {
+      Entry e;
+      e.offset = m.offset;
+      e.storedSize = m.size;
+      e.size = m.size;
+      e.mtime = m.mtime;
+      e.crc = 0;
+      e.method = 0;
+      add_entry(m.name, e, skipped);
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    return true;
+  }
+
+  bool read(size_t i, std::vector<uchar> &into) const {
+    into.resize(entries[i].size);
+    return read_at(entries[i].offset, into.data(), into.size());
+  }
+};
+
+// Zip archives (including zip64), with stored or deflated members.
+class ZipSource : public ArchiveSource {
+public:
+  bool open(const std::string &path, size_t &skipped) {
+    if(!open_file(path)) {
+      return false;
+    }
+    struct stat st;
+    if(fstat(fd, &st) != 0) {
+      return false;
+    }
+
+    // Find the end of central directory record, which sits in front of an
+    // optional comment of up to 64 KiB:
+    unsigned long long fileSize = st.st_size;
+    size_t tailLength = std::min<unsigned long long>(fileSize, 22 + 65535);
+    std::vector<unsigned char> tail(tailLength);
+    if(tailLength < 22 || !read_at(fileSize - tailLength, tail.data(), tailLength)) {
+      return false;
+    }
+    long eocd = -1;
+    for(long i = tailLength - 22; i >= 0; --i) {
+      if(le32(&tail[i]) == 0x06054b50) {
+        eocd = i;
+        break;
+      }
+    }
+    if(eocd < 0) {
+      return false;
+    }
+    unsigned long long count = le16(&tail[eocd + 10]);
+    unsigned long long directorySize = le32(&tail[eocd + 12]);
+    unsigned long long directoryOffset = le32(&tail[eocd + 16]);
+
+    if(count == 0xFFFF || directorySize == 0xFFFFFFFF || directoryOffset == 0xFFFFFFFF) {
+      // zip64: the real values are in the zip64 end of central directory
+      // record, found through the locator just before the classic one.
+      unsigned char locator[20], record[56];
+      unsigned long long eocdOffset = fileSize - tailLength + eocd;
+      if(eocdOffset < 20 || !read_at(eocdOffset - 20, locator, 20) || le32(locator) != 0x07064b50 ||
+         !read_at(le64(locator + 8), record, 56) || le32(record) != 0x06064b50) {
+        return false;
+      }
+      count = le64(record + 32);
+      directorySize = le64(record + 40);
+      directoryOffset = le64(record + 48);
+    }
+
+    std::vector<unsigned char> directory(directorySize);
+    if(!read_at(directoryOffset, directory.data(), directorySize)) {
+      return false;
+    }
+    size_t pos = 0;
+    for(unsigned long long n = 0; n < count; ++n) {
+      if(pos + 46 > directory.size() || le32(&directory[pos]) != 0x02014b50) {
+        fprintf(stderr, "Corrupt zip directory in '%s', ignoring the rest of the archive...\n", path.c_str());
+        break;
+      }
+      const unsigned char *h = &directory[pos];
+      unsigned int flags = le16(h + 8);
+      Entry e;
+      e.method = le16(h + 10);
+      e.mtime = dos_time(le16(h + 14), le16(h + 12));
+      e.crc = le32(h + 16);
+      e.storedSize = le32(h + 20);
+      e.size = le32(h + 24);
+      size_t nameLength = le16(h + 28);
+      size_t extraLength = le16(h + 30);
+      size_t commentLength = le16(h + 32);
+      e.offset = le32(h + 42);
+      if(pos + 46 + nameLength + extraLength + commentLength > directory.size()) {
+        break;
+      }
+      std::string memberName((const char *)h + 46, nameLength);
+      read_zip64_extra(h + 46 + nameLength, extraLength, e);
+      pos += 46 + nameLength + extraLength + commentLength;
+
+      if(memberName.empty() || memberName.back() == '/') {
+        continue; // Directory
+      }
+      if((flags & 1) || (e.method != 0 && e.method != Z_DEFLATED)) {
+        // Encrypted, or compressed with something other than deflate:
+        skipped = skipped + 1;
+        continue;
+      }
+      add_entry(memberName, e, skipped);
+    }
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    return true;
+  }
+
+  bool read(size_t i, std::vector<uchar> &into) const {
+    const Entry &e = entries[i];
+    if(e.storedSize > UINT32_MAX || e.size > UINT32_MAX) {
+      return false;
+    }
+    unsigned char local[30];
+    if(!read_at(e.offset, local, 30) || le32(local) != 0x04034b50) {
+      return false;
+    }
+    unsigned long long data = e.offset + 30 + le16(local + 26) + le16(local + 28);
+
+    into.resize(e.size);
+    if(e.method == 0) {
+      if(e.storedSize != e.size || !read_at(data, into.data(), e.size)) {
+        return false;
+      }
+    }
+    else {
+      static thread_local std::vector<uchar> compressed;
+      compressed.resize(e.storedSize);
+      if(!read_at(data, compressed.data(), e.storedSize)) {
+        return false;
+      }
+      z_stream z;
+      memset(&z, 0, sizeof(z));
+      if(inflateInit2(&z, -MAX_WBITS) != Z_OK) {
+        return false;
+      }
+      z.next_in = compressed.data();
+      z.avail_in = e.storedSize;
+      z.next_out = into.data();
+      z.avail_out = e.size;
+      int result = inflate(&z, Z_FINISH);
+      bool ok = result == Z_STREAM_END && z.total_out == e.size;
+      inflateEnd(&z);
+      if(!ok) {
+        return false;
+      }
+    }
+    return crc32(0, into.data(), into.size()) == e.crc;
+  }
+
+private:
+  static unsigned int le16(const unsigned char *p) {
+    return p[0] | (p[1] << 8);
+  }
+
+  static uint32_t le32(const unsigned char *p) {
+    return le16(p) | ((uint32_t)le16(p + 2) << 16);
+  }
+
+  static unsigned long long le64(const unsigned char *p) {
+    return le32(p) | ((unsigned long long)le32(p + 4) << 32);
+  }
+
+  static long long dos_time(unsigned int date, unsigned int time) {
+    struct tm t;
+    memset(&t, 0, sizeof(t));
+    t.tm_year = (date >> 9) + 80;
+    t.tm_mon = ((date >> 5) & 15) - 1;
+    t.tm_mday = date & 31;
+    t.tm_hour = time >> 11;
+    t.tm_min = (time >> 5) & 63;
+    t.tm_sec = (time & 31) * 2;
+    t.tm_isdst = -1;
+    return mktime(&t);
+  }
+
+  // Sizes and offsets that don't fit in 32 bits are saturated in the
+  // directory entry and stored, in this order, in a zip64 extra field.
+  static void read_zip64_extra(const unsigned char *extra, size_t length, Entry &e) {
+    size_t pos = 0;
+    while(pos + 4 <= length) {
+      unsigned int id = le16(extra + pos);
+      unsigned int size = le16(extra + pos + 2);
+      const unsigned char *p = extra + pos + 4;
+      const unsigned char *end = p + std::min<size_t>(size, length - pos - 4);
+      if(id == 0x0001) {
+        if(e.size == 0xFFFFFFFF && p + 8 <= end) {
+          e.size = le64(p);
+          p += 8;
+        }
+        if(e.storedSize == 0xFFFFFFFF && p + 8 <= end) {
+          e.storedSize = le64(p);
+          p += 8;
+        }
+        if(e.offset == 0xFFFFFFFF && p + 8 <= end) {
+          e.offset = le64(p);
+        }
+        return;
+      }
+      pos += 4 + size;
+    }
+  }
+};
+
+// An image read by an ImageStream. 'position' is how far through the stream
+// it was, out of the stream's total().
+struct StreamedImage {
+  std::string name;
+  unsigned long long size;
+  long long mtime;
+  unsigned long long position;
+  bool ok;
+  std::vector<uchar> bytes;
+};
+
+// Images read one after the other, by a single thread: the entries of an
+// ImageSource in a chosen order (IndexedStream), or the members of a tar
+// archive as they come (TarStream).
+class ImageStream {
+public:
+  virtual ~ImageStream() {
+  }
+
+  // Read the next image; false once there are none left. An image that
+  // couldn't be read comes back with ok == false.
+  virtual bool next(StreamedImage &into) = 0;
+
+  // The end of StreamedImage::position: the number of images, when they are
+  // counted() before they are read, or else the size of the archive.
+  virtual unsigned long long total() const = 0;
+  virtual bool counted() const = 0;
+
+  // Entries that aren't images, passed over so far.
+  virtual size_t skipped() const = 0;
+};
+
+// The entries 'indices' of 'source', in that order. With a non-zero
+// 'prefetch', the kernel is asked to start reading images that many images
+// ahead.
+class IndexedStream : public ImageStream {
+public:
+  IndexedStream(const ImageSource &source, const std::vector<size_t> &indices, size_t prefetch,
+                size_t skipped = 0)
+      : source(source), indices(indices), next_index(0), nonImages(skipped),
+        prefetcher(indices.size(), [this](size_t i) { this->source.will_need(this->indices[i]); }, prefetch) {
+  }
+
+  // Read all of an owned 'source', in 'order'.
+  IndexedStream(std::unique_ptr<ImageSource> owned, PathOrder order, size_t prefetch, size_t skipped)
+      : owned(std::move(owned)), source(*this->owned), indices(all_of(*this->owned, order)), next_index(0),
+        nonImages(skipped),
+        prefetcher(indices.size(), [this](size_t i) { this->source.will_need(this->indices[i]); }, prefetch) {
+  }
+
+  bool next(StreamedImage &into) {
+    if(next_index == indices.size()) {
+      return false;
+    }
+    size_t i = indices[next_index];
+    into.name = source.name(i);
+    into.size = 0;
+    into.mtime = 0;
+    source.stat(i, into.size, into.mtime);
+    into.position = next_index;
+    into.ok = source.read(i, into.bytes);
+    next_index = next_index + 1;
+    prefetcher.advance(next_index);
+    return true;
+  }
+
+  unsigned long long total() const {
+    return indices.size();
+  }
+
+  bool counted() const {
+    return true;
+  }
+
+  size_t skipped() const {
+    return nonImages;
+  }
+
+private:
+  static std::vector<size_t> all_of(const ImageSource &source, PathOrder order) {
+    std::vector<size_t> indices(source.size());
+    for(size_t i = 0; i < indices.size(); ++i) {
+      indices[i] = i;
+    }
+    source.order(indices, order);
+    return indices;
+  }
+
+  std::unique_ptr<ImageSource> owned;
+  const ImageSource &source;
+  std::vector<size_t> indices;
+  size_t next_index;
+  size_t nonImages;
+  Prefetcher prefetcher;
+};
+
+// A tar archive read straight through from front to back, each member's
+// header just before its data, so reading is one sequential pass with no
+// index built beforehand.
+class TarStream : public ImageStream {
+public:
+  TarStream() : fd(-1), offset(0), archiveSize(0), nonImages(0) {
+  }
+
+  ~TarStream() {
+    if(fd >= 0) {
+      close(fd);
+    }
+  }
+
+  bool open(const std::string &path) {
+    struct stat st;
+    fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0 || fstat(fd, &st) != 0) {
+      return false;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    reader.attach(fd, path);
+    archiveSize = st.st_size;
+    return true;
+  }
+
+  bool next(StreamedImage &into) {
+    TarReader::Member m;
+    while(reader.next(offset, m)) {
+      if(!is_image_member(m.name)) {
+        nonImages = nonImages + 1;
+        continue;
+      }
+      into.name = memberNames.unique(m.name);
+      into.size = m.size;
+      into.mtime = m.mtime;
+      into.position = offset;
+      into.bytes.resize(m.size);
+      into.ok = read_fully(fd, m.offset, into.bytes.data(), m.size);
+      return true;
+    }
+    return false;
+  }
+
+  unsigned long long total() const {
+    return archiveSize;
+  }
+
+  bool counted() const {
+    return false;
+  }
+
+  size_t skipped() const {
+    return nonImages;
+  }
+
+private:
+  int fd;
+  TarReader reader;
+  MemberNames memberNames;
+  unsigned long long offset;
+  unsigned long long archiveSize;
+  size_t nonImages;
+};
+
+// Open 'path' as an image source: a directory, or a tar or zip archive
+// (recognized by content, not by name). Returns an empty pointer if 'path'
+// is none of those. 'skipped' counts entries that aren't images.
+static std::unique_ptr<ImageSource> open_image_source(const std::string &path, size_t &skipped) {
+  skipped = 0;
+  struct stat st;
+  if(stat(path.c_str(), &st) != 0) {
+    return std::unique_ptr<ImageSource>();
+  }
+  if(S_ISDIR(st.st_mode)) {
+    std::unique_ptr<DirectorySource> source(new DirectorySource());
+    if(!source->open(path, skipped)) {
+      return std::unique_ptr<ImageSource>();
+    }
+    return std::move(source);
+  }
+
+  unsigned char header[512];
+  memset(header, 0, sizeof(header));
+  FILE *f = fopen(path.c_str(), "rb");
+  if(f == NULL) {
+    return std::unique_ptr<ImageSource>();
+  }
+  size_t length = fread(header, 1, sizeof(header), f);
+  fclose(f);
+
+  if(length >= 4 && header[0] == 'P' && header[1] == 'K' &&
+     ((header[2] == 3 && header[3] == 4) || (header[2] == 5 && header[3] == 6))) {
+    std::unique_ptr<ZipSource> source(new ZipSource());
+    if(source->open(path, skipped)) {
+      return std::move(source);
+    }
+  }
+  else if(length == 512 && TarReader::has_valid_header(header)) {
+    std::unique_ptr<TarSource> source(new TarSource());
+    if(source->open(path, skipped)) {
+      return std::move(source);
+    }
+  }
+  return std::unique_ptr<ImageSource>();
+}
+
+// Open 'path' to be read through once: tar archives are streamed, and
+// anything else is opened with open_image_source() and read in 'order'.
+static std::unique_ptr<ImageStream> open_image_stream(const std::string &path, PathOrder order, size_t prefetch) {
+  unsigned char header[512];
+  FILE *f = fopen(path.c_str(), "rb");
+  if(f != NULL) {
+    size_t length = fread(header, 1, sizeof(header), f);
+    fclose(f);
+    if(length == 512 && TarReader::has_valid_header(header)) {
+      std::unique_ptr<TarStream> stream(new TarStream());
+      if(!stream->open(path)) {
+        return std::unique_ptr<ImageStream>();
+      }
+      return std::move(stream);
+    }
+  }
+  size_t skipped = 0;
+  std::unique_ptr<ImageSource> source = open_image_source(path, skipped);
+  if(!source) {
+    return std::unique_ptr<ImageStream>();
+  }
+  return std::unique_ptr<ImageStream>(new IndexedStream(std::move(source), order, prefetch, skipped));
+}
+
+#endif /* HT_IMAGE_SOURCE_HPP */
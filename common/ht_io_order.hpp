@@ -0,0 +1,187 @@
+#ifndef HT_IO_ORDER_HPP
+#define HT_IO_ORDER_HPP
+
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include "ht_image_paths.hpp"
+#include "ht_queue.hpp"
+
+// Reading millions of small files in path order makes a spinning disk seek
+// back and forth across the platter. Sorting the files by inode number
+// roughly follows allocation order on most filesystems, and sorting by the
+// physical offset of each file's first extent (FIEMAP) follows the actual
+// layout. Together with a prefetcher that asks the kernel to start reading
+// the next few files early, this turns most seeks into short forward skips.
+
+enum PathOrder {ORDER_PATH, ORDER_INODE, ORDER_EXTENT};
+
+static bool parse_path_order(const char *name, PathOrder &into) {
+  if(strcmp(name, "path") == 0) {
+    into = ORDER_PATH;
+  }
+  else if(strcmp(name, "inode") == 0) {
+    into = ORDER_INODE;
+  }
+  else if(strcmp(name, "extent") == 0) {
+    into = ORDER_EXTENT;
+  }
+  else {
+    return false;
+  }
+  return true;
+}
+
+// Physical byte offset of the first extent of an open file, if the
+// filesystem supports FIEMAP and the file has any extents.
+static bool first_extent_of(int fd, uint64_t &physical) {
+  // Room for the request header and a single extent:
+  uint64_t buffer[(sizeof(fiemap) + sizeof(fiemap_extent)) / sizeof(uint64_t) + 1];
+  memset(buffer, 0, sizeof(buffer));
+  fiemap *request = (fiemap *)buffer;
+  request->fm_start = 0;
+  request->fm_length = FIEMAP_MAX_OFFSET;
+  request->fm_extent_count = 1;
+  if(ioctl(fd, FS_IOC_FIEMAP, request) != 0 || request->fm_mapped_extents == 0) {
+    return false;
+  }
+  physical = request->fm_extents[0].fe_physical;
+  return true;
+}
+
+// Put 'indices' (into 'paths') in the order in which to read them. Files
+// that can't be located sort last, in their original order. Looking files up
+// is latency bound, so it is spread over 'threads' workers.
+static void path_order(const PathList &paths, std::vector<size_t> &indices,
+                       PathOrder order, unsigned int threads) {
+  // Offsets and inode numbers only mean anything within one filesystem, so
+  // files are grouped by device first.
+  struct Key {
+    uint64_t device;
+    uint64_t major;
+    uint64_t minor;
+    size_t index;
+    bool operator<(const Key &other) const {
+      if(device != other.device) {
+        return device < other.device;
+      }
+      if(major != other.major) {
+        return major < other.major;
+      }
+      if(minor != other.minor) {
+        return minor < other.minor;
+      }
+      return index < other.index;
+    }
+  };
+
+  if(order == ORDER_PATH) {
+    return;
+  }
+  std::vector<Key> keys(indices.size());
+  std::atomic<size_t> next(0);
+  auto locate = [&]() {
+    size_t i;
+    while((i = next.fetch_add(1)) < keys.size()) {
+      Key &k = keys[i];
+      k.index = indices[i];
+      k.device = UINT64_MAX;
+      k.major = 0;
+      k.minor = i;
+      int fd = open(paths[k.index], O_RDONLY | O_CLOEXEC);
+      if(fd < 0) {
+        continue;
+      }
+      struct stat st;
+      uint64_t physical;
+      if(fstat(fd, &st) == 0) {
+        k.device = st.st_dev;
+        if(order == ORDER_EXTENT && first_extent_of(fd, physical)) {
+          k.major = 0;
+          k.minor = physical;
+        }
+        else {
+          // Inode order, also the fallback for files without extents:
+          k.major = 1;
+          k.minor = st.st_ino;
+        }
+      }
+      close(fd);
+    }
+  };
+
+  std::vector<std::thread> pool;
+  for(unsigned int t = 1; t < threads; ++t) {
+    pool.push_back(std::thread(locate));
+  }
+  locate();
+  for(auto &t : pool) {
+    t.join();
+  }
+
+  std::sort(keys.begin(), keys.end());
+  for(size_t i = 0; i < keys.size(); ++i) {
+    indices[i] = keys[i].index;
+  }
+}
+
+// Calls hint(i) for items up to 'window' items ahead of the consumer, which
+// reports its progress with advance(); hint() is expected to ask the kernel
+// to start reading item i. A window of 0 turns the prefetcher off.
+class Prefetcher {
+public:
+  Prefetcher(size_t count, std::function<void(size_t)> hint, size_t window)
+      : count(count), hint(hint), window(window), consumed(0), stopping(false) {
+    if(window > 0) {
+      worker = std::thread(&Prefetcher::run, this);
+    }
+  }
+
+  ~Prefetcher() {
+    stopping.store(true, std::memory_order_release);
+    if(worker.joinable()) {
+      worker.join();
+    }
+  }
+
+  void advance(size_t count) {
+    consumed.store(count, std::memory_order_release);
+  }
+
+private:
+  void run() {
+    for(size_t i = 0; i < count; ++i) {
+      unsigned int attempt = 0;
+      while(i >= consumed.load(std::memory_order_acquire) + window) {
+        if(stopping.load(std::memory_order_acquire)) {
+          return;
+        }
+        backoff(attempt);
+      }
+      if(stopping.load(std::memory_order_acquire)) {
+        return;
+      }
+      hint(i);
+    }
+  }
+
+  size_t count;
+  std::function<void(size_t)> hint;
+  size_t window;
+  std::atomic<size_t> consumed;
+  std::atomic<bool> stopping;
+  std::thread worker;
+};
+
+#endif /* HT_IO_ORDER_HPP */
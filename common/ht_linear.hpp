@@ -0,0 +1,117 @@
+#ifndef HT_LINEAR_HPP
+#define HT_LINEAR_HPP
+
+#include <string>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+// A CvSVM whose decision function can be collapsed into a single weight
+// vector when it has a linear kernel. CvSVM evaluates
+// sum = -rho + sum_k alpha[k] * <sv[k], x> and predicts the first (lowest)
+// class label when sum > 0; with hog_trainer's -1/+1 labels that makes
+// score = -sum = w.x + b, with w = -sum_k alpha[k] * sv[k] and b = rho,
+// positive exactly when CvSVM predicts +1 (score >= 0).
+class LinearSVM : public CvSVM {
+public:
+  bool collapse(std::vector<float> &w, double &bias) const {
+    if(decision_func == NULL || class_labels == NULL ||
+       params.svm_type != CvSVM::C_SVC || params.kernel_type != CvSVM::LINEAR) {
+      return false;
+    }
+    const int *labels = class_labels->data.i;
+    if(class_labels->rows * class_labels->cols != 2 || labels[0] != -1 || labels[1] != 1) {
+      return false;
+    }
+
+    const CvSVMDecisionFunc &df = decision_func[0];
+    std::vector<double> sum(get_var_count(), 0.0);
+    for(int k = 0; k < df.sv_count; ++k) {
+      const float *sv = get_support_vector(df.sv_index != NULL ? df.sv_index[k] : k);
+      for(size_t d = 0; d < sum.size(); ++d) {
+        sum[d] = sum[d] - df.alpha[k] * sv[d];
+      }
+    }
+    w.assign(sum.begin(), sum.end());
+    bias = df.rho;
+    return true;
+  }
+};
+
+// w.x + bias, with four sums to keep the adds from waiting on each other.
+static inline double linear_score(const std::vector<float> &w, double bias, const float *x) {
+  const size_t width = w.size();
+  double s0 = 0.0, s1 = 0.0, s2 = 0.0, s3 = 0.0;
+  size_t d = 0;
+  for(; d + 4 <= width; d = d + 4) {
+    s0 = s0 + w[d] * x[d];
+    s1 = s1 + w[d + 1] * x[d + 1];
+    s2 = s2 + w[d + 2] * x[d + 2];
+    s3 = s3 + w[d + 3] * x[d + 3];
+  }
+  for(; d < width; ++d) {
+    s0 = s0 + w[d] * x[d];
+  }
+  return (s0 + s1) + (s2 + s3) + bias;
+}
+
+// Save the decision function w.x + b of a linear model trained outside of
+// CvSVM (hog_trainer --solver dcd) in CvSVM's own XML format, so that
+// CvSVM::load() and LinearSVM can read it. It is stored the way CvSVM stores
+// a linear model once it has collapsed it: a single support vector -w with
+// weight 1, and rho = b. 'params' (C and the stopping criteria) are only
+// recorded.
+static inline bool save_linear_svm(const std::string &path, const std::vector<float> &w, double bias,
+                                   const CvSVMParams &params) {
+  cv::FileStorage fs(path, cv::FileStorage::WRITE);
+  if(!fs.isOpened()) {
+    return false;
+  }
+  int labels[2] = {-1, 1};
+  fs << "my_svm" << "{opencv-ml-svm";
+  fs << "svm_type" << "C_SVC";
+  fs << "kernel" << "{:" << "type" << "LINEAR" << "}";
+  fs << "C" << params.C;
+  fs << "term_criteria" << "{:" << "epsilon" << params.term_crit.epsilon
+     << "iterations" << params.term_crit.max_iter << "}";
+  fs << "var_all" << (int)w.size();
+  fs << "var_count" << (int)w.size();
+  fs << "class_count" << 2;
+  fs << "class_labels" << cv::Mat(1, 2, CV_32S, labels);
+  fs << "sv_total" << 1;
+  fs << "support_vectors" << "[" << "[:";
+  for(size_t d = 0; d < w.size(); ++d) {
+    fs << -w[d];
+  }
+  fs << "]" << "]";
+  fs << "decision_functions" << "[" << "{";
+  fs << "sv_count" << 1;
+  fs << "rho" << bias;
+  fs << "alpha" << "[:" << 1.0 << "]";
+  fs << "index" << "[:" << 0 << "]";
+  fs << "}" << "]";
+  fs << "}";
+  fs.release();
+  return true;
+}
+
+// Save w followed by b, the layout HOGDescriptor::setSVMDetector() takes (its
+// detections are the windows where w.x + b is at least the hit threshold),
+// as a single list named "detector":
+//   cv::FileStorage("model.yml", cv::FileStorage::READ)["detector"] >> v;
+//   hog.setSVMDetector(v);
+static inline bool save_detector(const std::string &path, const std::vector<float> &w, double bias) {
+  cv::FileStorage fs(path, cv::FileStorage::WRITE);
+  if(!fs.isOpened()) {
+    return false;
+  }
+  fs << "detector" << "[:";
+  for(size_t d = 0; d < w.size(); ++d) {
+    fs << w[d];
+  }
+  fs << (float)bias;
+  fs << "]";
+  fs.release();
+  return true;
+}
+
+#endif /* HT_LINEAR_HPP */
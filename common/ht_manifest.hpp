@@ -0,0 +1,86 @@
+#ifndef HT_MANIFEST_HPP
+#define HT_MANIFEST_HPP
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// A HOGSNRT manifest is a text sidecar ("<feature file>.manifest") that maps
+// every ingested image to the rows it produced, along with the size and
+// modification time the image had at the time. hog_snort --append uses it to
+// find new, changed and deleted images without re-reading the others.
+//
+//   HOGSNRT-MANIFEST 1
+//   <row>\t<rows>\t<size>\t<mtime>\t<path>
+//   ...
+
+struct ManifestEntry {
+  unsigned long long size;
+  long long mtime;
+  unsigned long long row;
+  unsigned int rows;
+};
+
+typedef std::unordered_map<std::string, ManifestEntry> Manifest;
+
+static std::string manifest_path_for(const std::string &featurePath) {
+  return featurePath + ".manifest";
+}
+
+static bool load_manifest(const std::string &path, Manifest &into) {
+  FILE *f = fopen(path.c_str(), "r");
+  if(f == NULL) {
+    return false;
+  }
+
+  char line[8192];
+  if(fgets(line, sizeof(line), f) == NULL || strcmp(line, "HOGSNRT-MANIFEST 1\n") != 0) {
+    fclose(f);
+    return false;
+  }
+
+  while(fgets(line, sizeof(line), f) != NULL) {
+    ManifestEntry e;
+    int consumed = 0;
+    if(sscanf(line, "%llu\t%u\t%llu\t%lld\t%n", &e.row, &e.rows, &e.size, &e.mtime, &consumed) != 4 || consumed == 0) {
+      fclose(f);
+      return false;
+    }
+    std::string imagePath(line + consumed);
+    if(!imagePath.empty() && imagePath.back() == '\n') {
+      imagePath.pop_back();
+    }
+    into[imagePath] = e;
+  }
+  fclose(f);
+  return true;
+}
+
+// Write the manifest in row order, through a temporary file so that a crash
+// never leaves a half-written manifest behind.
+static bool save_manifest(const std::string &path, const Manifest &manifest) {
+  std::vector<std::pair<unsigned long long, const std::string *>> order;
+  for(auto &e : manifest) {
+    order.push_back(std::make_pair(e.second.row, &e.first));
+  }
+  std::sort(order.begin(), order.end());
+
+  std::string tempPath = path + ".tmp";
+  FILE *f = fopen(tempPath.c_str(), "w");
+  if(f == NULL) {
+    return false;
+  }
+  fprintf(f, "HOGSNRT-MANIFEST 1\n");
+  for(auto &o : order) {
+    const ManifestEntry &e = manifest.at(*o.second);
+    fprintf(f, "%llu\t%u\t%llu\t%lld\t%s\n", e.row, e.rows, e.size, e.mtime, o.second->c_str());
+  }
+  bool ok = fclose(f) == 0;
+  return ok && rename(tempPath.c_str(), path.c_str()) == 0;
+}
+
+#endif /* HT_MANIFEST_HPP */
@@ -0,0 +1,189 @@
+#ifndef HT_PIPELINE_HPP
+#define HT_PIPELINE_HPP
+
+#include <limits.h>
+#include <stdio.h>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+#include "ht_cache.hpp"
+#include "ht_decode.hpp"
+#include "ht_hog.hpp"
+#include "ht_image_source.hpp"
+#include "ht_io_order.hpp"
+#include "ht_queue.hpp"
+#include "ht_stats.hpp"
+#include "ht_windows.hpp"
+
+// One image on its way through the feature extraction pipeline. 'index' is
+// the image's position in the stream being processed, and 'contentHash' a
+// hash of its file that seeds the windows a sampler takes from it.
+struct PipelineItem : public StreamedImage {
+  size_t index;
+  bool cached;
+  CacheKey cacheKey;
+  uint64_t contentHash;
+  cv::Mat image;
+  std::vector<float> features;
+};
+
+typedef std::unique_ptr<PipelineItem> PipelineItemPtr;
+
+// Extract HOG features from the images of 'stream', overlapping reads,
+// decoding and feature computation:
+//
+//   reader (1 thread) -> decode+resize (n threads) -> HOG (n threads) -> sink
+//
+// Stages are connected by bounded lock-free queues, and the reader never gets
+// more than a fixed window of images ahead of the sink, so memory use doesn't
+// depend on the size of the data set. sink() runs on the calling thread and
+// sees every item in stream order, including ones that failed to load (with
+// ok == false). Every stage is timed (see ht_stats.hpp), and
+// traced on lanes named after the stages.
+//
+// With a feature cache, decoders look every file up by content before
+// decoding it, and cache hits skip straight past the HOG stage; extractors
+// store the features of every miss.
+//
+// With a window 'sampler', images are decoded at full size instead of being
+// resized to the window, and each item's features are the descriptors of
+// all the windows the sampler takes from it, one after the other (none if
+// the image is smaller than the window).
+static void run_feature_pipeline(ImageStream &stream, cv::Size window, unsigned int threads,
+                                 std::function<void(PipelineItem &)> sink,
+                                 const FeatureCache *cache = NULL,
+                                 const WindowSampler *sampler = NULL) {
+  const size_t inFlight = threads * 8 > 64 ? threads * 8 : 64;
+
+  BoundedQueue<PipelineItemPtr> readQueue(threads * 2, 1);
+  BoundedQueue<PipelineItemPtr> decodeQueue(threads * 2, threads);
+  BoundedQueue<PipelineItemPtr> hogQueue(inFlight, threads);
+  std::atomic<size_t> written(0);
+
+  auto reader = [&]() {
+    trace_thread_name("reader");
+    for(size_t i = 0; ; ++i) {
+      unsigned int attempt = 0;
+      while(i >= written.load(std::memory_order_acquire) + inFlight) {
+        backoff(attempt);
+      }
+      PipelineItemPtr item(new PipelineItem());
+      item->index = i;
+      item->cached = false;
+      item->contentHash = 0;
+      bool more;
+      {
+        StageTimer timer(STAT_READ, 0, i);
+        more = stream.next(*item);
+        timer.set_bytes(item->bytes.size());
+      }
+      if(!more) {
+        break;
+      }
+      readQueue.push(item);
+    }
+    readQueue.close();
+  };
+
+  auto decoder = [&]() {
+    trace_thread_name("decoder");
+    PipelineItemPtr item;
+    while(readQueue.pop(item)) {
+      if(item->ok && cache != NULL) {
+        StageTimer timer(STAT_CACHE, 0, item->index);
+        item->cacheKey = cache->key_for(item->bytes);
+        item->cached = cache->lookup(item->cacheKey, item->features);
+      }
+      if(item->ok && !item->cached && sampler != NULL) {
+        StageTimer timer(STAT_DECODE, item->bytes.size(), item->index);
+        item->contentHash = murmur_hash64(item->bytes.data(), item->bytes.size(), 0);
+        item->image = decode_grayscale(item->bytes, cv::Size(INT_MAX, INT_MAX));
+        item->ok = !item->image.empty();
+        item->image = sampler->tileable(item->image);
+      }
+      else if(item->ok && !item->cached) {
+        // Decode straight to grayscale, at reduced size where possible:
+        {
+          StageTimer timer(STAT_DECODE, item->bytes.size(), item->index);
+          item->image = decode_grayscale(item->bytes, window);
+          item->ok = !item->image.empty();
+        }
+        if(item->ok) {
+          StageTimer timer(STAT_RESIZE, 0, item->index);
+          cv::resize(item->image, item->image, window);
+        }
+      }
+      std::vector<uchar>().swap(item->bytes);
+      decodeQueue.push(item);
+    }
+    decodeQueue.close();
+  };
+
+  auto extractor = [&]() {
+    trace_thread_name("hog");
+    HogExtractor hog(window);
+    std::vector<float> blocks;
+    std::vector<cv::Point> windows;
+    const size_t width = hog.descriptor_size();
+    PipelineItemPtr item;
+    while(decodeQueue.pop(item)) {
+      if(item->ok && !item->cached && sampler != NULL) {
+        StageTimer timer(STAT_HOG, 0, item->index);
+        sampler->positions(item->contentHash, item->image.size(), windows);
+        item->features.resize(windows.size() * width);
+        if(!windows.empty()) {
+          hog.compute_blocks(item->image, blocks);
+        }
+        for(size_t w = 0; w < windows.size(); ++w) {
+          sampler->assemble(blocks, item->image.size(), windows[w], item->features.data() + w * width);
+        }
+      }
+      else if(item->ok && !item->cached) {
+        StageTimer timer(STAT_HOG, 0, item->index);
+        hog.compute(item->image, item->features);
+      }
+      if(item->ok && !item->cached) {
+        item->image.release();
+        if(cache != NULL) {
+          StageTimer timer(STAT_CACHE, 0, item->index);
+          cache->store(item->cacheKey, item->features);
+        }
+      }
+      hogQueue.push(item);
+    }
+    hogQueue.close();
+  };
+
+  std::vector<std::thread> stages;
+  stages.push_back(std::thread(reader));
+  for(unsigned int t = 0; t < threads; ++t) {
+    stages.push_back(std::thread(decoder));
+    stages.push_back(std::thread(extractor));
+  }
+
+  // Put the results back in order before handing them to the sink:
+  std::vector<PipelineItemPtr> pending(inFlight);
+  size_t next = 0;
+  PipelineItemPtr item;
+  while(hogQueue.pop(item)) {
+    size_t slot = item->index % inFlight;
+    pending[slot] = std::move(item);
+    while(pending[next % inFlight]) {
+      sink(*pending[next % inFlight]);
+      pending[next % inFlight].reset();
+      next = next + 1;
+      written.store(next, std::memory_order_release);
+    }
+  }
+
+  for(auto &t : stages) {
+    t.join();
+  }
+}
+
+#endif /* HT_PIPELINE_HPP */
@@ -0,0 +1,223 @@
+#ifndef HT_QUANTIZE_HPP
+#define HT_QUANTIZE_HPP
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <istream>
+#include <ostream>
+#include <vector>
+
+#include "ht_dtype.hpp"
+#include "ht_features.hpp"
+
+// 8-bit quantized feature rows. Every dimension gets its own affine mapping
+// from the range of values seen in it, x = offset + scale * q for q in
+// [0, 255], so a dimension that only ever reaches 0.05 still gets all 256
+// levels. Rows are a quarter of the size of float rows; the worst-case error
+// per element is half a step, (max - min) / 510.
+//
+// A linear model can be scored against quantized rows without widening them:
+// w.x + b = (b + sum w[d] * offset[d]) + sum (w[d] * scale[d]) * q[d], and the
+// second sum is done in integers with the folded weights quantized to int16.
+
+class QuantizationTable {
+public:
+  QuantizationTable() {
+  }
+
+  // A table covering [low[d], high[d]] in every dimension.
+  QuantizationTable(const std::vector<float> &low, const std::vector<float> &high)
+      : scale(low.size()), offset(low.size()), inverse(low.size()) {
+    for(size_t d = 0; d < low.size(); ++d) {
+      offset[d] = low[d];
+      scale[d] = high[d] > low[d] ? (high[d] - low[d]) / 255.0f : 0.0f;
+    }
+    update_inverse();
+  }
+
+  // The table stored in a quantized features file, 'data' being the start of
+  // the file.
+  QuantizationTable(const FeatureHeader &header, const char *data)
+      : scale(header.width), offset(header.width), inverse(header.width) {
+    memcpy(scale.data(), data + header.tableOffset, header.width * sizeof(float));
+    memcpy(offset.data(), data + header.tableOffset + header.width * sizeof(float), header.width * sizeof(float));
+    update_inverse();
+  }
+
+  size_t width() const {
+    return scale.size();
+  }
+
+  // Values outside the table's range are clamped to it; returns how many
+  // were.
+  size_t quantize(const float *in, uint8_t *out) const {
+    size_t clamped = 0;
+    for(size_t d = 0; d < scale.size(); ++d) {
+      float q = (in[d] - offset[d]) * inverse[d] + 0.5f;
+      clamped += q < 0.0f || q >= 256.0f || (inverse[d] == 0.0f && in[d] != offset[d]);
+      q = std::max(0.0f, std::min(255.0f, q));
+      out[d] = (uint8_t)q;
+    }
+    return clamped;
+  }
+
+  void dequantize(const uint8_t *in, float *out) const {
+    for(size_t d = 0; d < scale.size(); ++d) {
+      out[d] = offset[d] + scale[d] * in[d];
+    }
+  }
+
+  bool read(const FeatureHeader &header, std::istream &f) {
+    scale.resize(header.width);
+    offset.resize(header.width);
+    inverse.resize(header.width);
+    f.seekg(header.tableOffset);
+    f.read((char *)scale.data(), scale.size() * sizeof(float));
+    f.read((char *)offset.data(), offset.size() * sizeof(float));
+    update_inverse();
+    return !f.fail();
+  }
+
+  void write(const FeatureHeader &header, std::ostream &f) const {
+    f.seekp(header.tableOffset);
+    f.write((const char *)scale.data(), scale.size() * sizeof(float));
+    f.write((const char *)offset.data(), offset.size() * sizeof(float));
+  }
+
+  std::vector<float> scale;
+  std::vector<float> offset;
+
+private:
+  void update_inverse() {
+    for(size_t d = 0; d < scale.size(); ++d) {
+      inverse[d] = scale[d] > 0.0f ? 1.0f / scale[d] : 0.0f;
+    }
+  }
+
+  std::vector<float> inverse;
+};
+
+// Running per-dimension minimum and maximum of a set of rows.
+class FeatureRange {
+public:
+  explicit FeatureRange(size_t width)
+      : low(width, INFINITY), high(width, -INFINITY) {
+  }
+
+  void add(const float *row) {
+    for(size_t d = 0; d < low.size(); ++d) {
+      low[d] = std::min(low[d], row[d]);
+      high[d] = std::max(high[d], row[d]);
+    }
+  }
+
+  // Dimensions that never saw a value map everything to zero.
+  QuantizationTable table() const {
+    std::vector<float> l = low, h = high;
+    for(size_t d = 0; d < l.size(); ++d) {
+      if(!(l[d] <= h[d])) {
+        l[d] = 0.0f;
+        h[d] = 0.0f;
+      }
+    }
+    return QuantizationTable(l, h);
+  }
+
+private:
+  std::vector<float> low;
+  std::vector<float> high;
+};
+
+#ifdef HT_DTYPE_X86
+// Each madd lane gains at most 2 * 255 * 32767 per step, so an int32 lane is
+// flushed to 64 bits every 64 steps, well before it could overflow.
+#define HT_QUANTIZE_FLUSH 64
+
+__attribute__((target("avx2")))
+static inline int64_t quantized_dot_avx2(const uint8_t *q, const int16_t *w, size_t count, size_t &done) {
+  __m256i total = _mm256_setzero_si256();
+  size_t i = 0;
+  while(i + 16 <= count) {
+    __m256i sum = _mm256_setzero_si256();
+    for(unsigned int step = 0; step < HT_QUANTIZE_FLUSH && i + 16 <= count; ++step, i += 16) {
+      __m256i x = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(q + i)));
+      __m256i y = _mm256_loadu_si256((const __m256i *)(w + i));
+      sum = _mm256_add_epi32(sum, _mm256_madd_epi16(x, y));
+    }
+    total = _mm256_add_epi64(total, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(sum)));
+    total = _mm256_add_epi64(total, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(sum, 1)));
+  }
+  int64_t lanes[4];
+  _mm256_storeu_si256((__m256i *)lanes, total);
+  done = i;
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+
+static inline int64_t quantized_dot_sse2(const uint8_t *q, const int16_t *w, size_t count, size_t &done) {
+  const __m128i zero = _mm_setzero_si128();
+  int64_t total = 0;
+  size_t i = 0;
+  while(i + 8 <= count) {
+    __m128i sum = _mm_setzero_si128();
+    for(unsigned int step = 0; step < HT_QUANTIZE_FLUSH && i + 8 <= count; ++step, i += 8) {
+      __m128i x = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(q + i)), zero);
+      __m128i y = _mm_loadu_si128((const __m128i *)(w + i));
+      sum = _mm_add_epi32(sum, _mm_madd_epi16(x, y));
+    }
+    int32_t lanes[4];
+    _mm_storeu_si128((__m128i *)lanes, sum);
+    total = total + lanes[0] + lanes[1] + lanes[2] + lanes[3];
+  }
+  done = i;
+  return total;
+}
+#endif
+
+// A linear model w.x + b folded into a quantization table, scoring quantized
+// rows with integer SIMD (AVX2 or SSE2, picked at runtime). Scores are within
+// about width * 255 * step / 2 of w.x + b over the dequantized row, step
+// being the largest folded weight / 32767.
+class QuantizedLinearModel {
+public:
+  QuantizedLinearModel(const std::vector<float> &w, double bias, const QuantizationTable &table)
+      : weights(w.size()), step(0.0), constant(bias) {
+    double largest = 0.0;
+    std::vector<double> folded(w.size());
+    for(size_t d = 0; d < w.size(); ++d) {
+      folded[d] = (double)w[d] * table.scale[d];
+      constant = constant + (double)w[d] * table.offset[d];
+      largest = std::max(largest, fabs(folded[d]));
+    }
+    step = largest > 0.0 ? largest / 32767.0 : 1.0;
+    for(size_t d = 0; d < w.size(); ++d) {
+      weights[d] = (int16_t)lrint(folded[d] / step);
+    }
+  }
+
+  double score(const uint8_t *q) const {
+    size_t count = weights.size();
+    size_t i = 0;
+    int64_t sum = 0;
+#ifdef HT_DTYPE_X86
+    if(dtype_has_avx2()) {
+      sum = quantized_dot_avx2(q, weights.data(), count, i);
+    }
+    else {
+      sum = quantized_dot_sse2(q, weights.data(), count, i);
+    }
+#endif
+    for(; i < count; ++i) {
+      sum = sum + (int32_t)q[i] * weights[i];
+    }
+    return constant + step * (double)sum;
+  }
+
+private:
+  std::vector<int16_t> weights;
+  double step;
+  double constant;
+};
+
+#endif /* HT_QUANTIZE_HPP */
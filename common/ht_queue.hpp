@@ -0,0 +1,136 @@
+#ifndef HT_QUEUE_HPP
+#define HT_QUEUE_HPP
+
+#include <stddef.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+// Back off while waiting on another thread: spin briefly, then yield, then
+// sleep, so idle pipeline stages don't burn a core.
+static void backoff(unsigned int &attempt) {
+  if(attempt < 64) {
+    // Busy-wait; the other side is usually only a few instructions away.
+  }
+  else if(attempt < 128) {
+    std::this_thread::yield();
+  }
+  else {
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
+  }
+  attempt = attempt + 1;
+}
+
+// A bounded multi-producer/multi-consumer lock-free queue (after Dmitry
+// Vyukov's design). Each cell carries a sequence number that tells producers
+// and consumers whether it is free or full, so the only shared writes are one
+// CAS on the head or tail index per operation.
+//
+// push() blocks while the queue is full, which is what provides back-pressure
+// between pipeline stages. Every producer calls close() when it is done; once
+// all of them have, pop() returns false as soon as the queue drains.
+template<typename T>
+class BoundedQueue {
+public:
+  BoundedQueue(size_t capacity, unsigned int producers)
+      : cells(round_up(capacity)), mask(round_up(capacity) - 1),
+        head(0), tail(0), openProducers(producers) {
+    for(size_t i = 0; i < cells.size(); ++i) {
+      cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  bool try_push(T &value) {
+    size_t pos = tail.load(std::memory_order_relaxed);
+    for(;;) {
+      Cell &cell = cells[pos & mask];
+      size_t seq = cell.sequence.load(std::memory_order_acquire);
+      ptrdiff_t diff = (ptrdiff_t)seq - (ptrdiff_t)pos;
+      if(diff == 0) {
+        if(tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          cell.value = std::move(value);
+          cell.sequence.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      }
+      else if(diff < 0) {
+        return false; // Full
+      }
+      else {
+        pos = tail.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  bool try_pop(T &value) {
+    size_t pos = head.load(std::memory_order_relaxed);
+    for(;;) {
+      Cell &cell = cells[pos & mask];
+      size_t seq = cell.sequence.load(std::memory_order_acquire);
+      ptrdiff_t diff = (ptrdiff_t)seq - (ptrdiff_t)(pos + 1);
+      if(diff == 0) {
+        if(head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          value = std::move(cell.value);
+          cell.sequence.store(pos + mask + 1, std::memory_order_release);
+          return true;
+        }
+      }
+      else if(diff < 0) {
+        return false; // Empty
+      }
+      else {
+        pos = head.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  void push(T &value) {
+    unsigned int attempt = 0;
+    while(!try_push(value)) {
+      backoff(attempt);
+    }
+  }
+
+  bool pop(T &value) {
+    unsigned int attempt = 0;
+    for(;;) {
+      if(try_pop(value)) {
+        return true;
+      }
+      if(openProducers.load(std::memory_order_acquire) == 0) {
+        // Producers may have pushed between our failed pop and their close():
+        return try_pop(value);
+      }
+      backoff(attempt);
+    }
+  }
+
+  void close() {
+    openProducers.fetch_sub(1, std::memory_order_release);
+  }
+
+private:
+  struct Cell {
+    std::atomic<size_t> sequence;
+    T value;
+  };
+
+  static size_t round_up(size_t n) {
+    size_t p = 2;
+    while(p < n) {
+      p <<= 1;
+    }
+    return p;
+  }
+
+  std::vector<Cell> cells;
+  const size_t mask;
+  // Keep the indices on separate cache lines so producers and consumers
+  // don't false-share:
+  alignas(64) std::atomic<size_t> head;
+  alignas(64) std::atomic<size_t> tail;
+  alignas(64) std::atomic<unsigned int> openProducers;
+};
+
+#endif /* HT_QUEUE_HPP */
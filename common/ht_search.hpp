@@ -0,0 +1,249 @@
+#ifndef HT_SEARCH_HPP
+#define HT_SEARCH_HPP
+
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <algorithm>
+#include <mutex>
+#include <random>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+#include "ht_dcd.hpp"
+#include "ht_stats.hpp"
+#include "ht_threads.hpp"
+
+// Choosing C by cross-validation (hog_trainer --auto), in place of
+// CvSVM::train_auto(), which tries every grid point one after the other on
+// one thread and starts every one of them from scratch.
+//
+// The examples are split into folds once, as lists of rows of the one
+// training matrix, so no fold copies any features. Every fold sweeps the
+// grid from its smallest C up, starting each point from the dual variables
+// of the one before: the support vectors change little between neighbouring
+// values of C, so later points need fewer passes to converge. Folds, and
+// runs of the grid within each fold when there are more threads than
+// folds, are trained concurrently, with as many of them at once as the
+// memory budget allows. Each grid point is logged as soon as all of its
+// folds are done.
+//
+// hog_trainer only trains linear models, so there is no gamma to search.
+//
+// hog_trainer --cv cross-validates a single C the same way, with one fold to
+// a thread.
+
+const unsigned int HT_SEARCH_FOLDS = 5;
+const size_t HT_SEARCH_DEFAULT_MB = 1024;
+
+// C = min, min * step, min * step^2, ... up to max.
+struct SearchGrid {
+  SearchGrid() : min(1e-4), max(10.0), step(4.0) {
+  }
+
+  std::vector<double> values() const {
+    std::vector<double> v;
+    for(double c = min; c <= max * (1.0 + 1e-9); c = c * step) {
+      v.push_back(c);
+    }
+    return v;
+  }
+
+  double min;
+  double max;
+  double step;
+};
+
+// Parse "<min>:<max>:<step>".
+static inline bool parse_search_grid(const char *spec, SearchGrid &into) {
+  SearchGrid grid;
+  char extra;
+  if(sscanf(spec, "%lf:%lf:%lf%c", &grid.min, &grid.max, &grid.step, &extra) != 3 ||
+     grid.min <= 0.0 || grid.max < grid.min || grid.step <= 1.0) {
+    return false;
+  }
+  into = grid;
+  return true;
+}
+
+// The rows of each of 'k' folds, with positives and negatives spread evenly
+// over them in a random order drawn from 'seed'.
+static inline std::vector<std::vector<int> > make_folds(const cv::Mat &labels, unsigned int k, uint64_t seed) {
+  std::vector<int> positive;
+  std::vector<int> negative;
+  for(int r = 0; r < labels.rows; ++r) {
+    (labels.at<float>(r, 0) > 0 ? positive : negative).push_back(r);
+  }
+  std::mt19937_64 random(seed);
+  std::shuffle(positive.begin(), positive.end(), random);
+  std::shuffle(negative.begin(), negative.end(), random);
+
+  std::vector<std::vector<int> > folds(k);
+  size_t next = 0;
+  for(int r : positive) {
+    folds[next % k].push_back(r);
+    next = next + 1;
+  }
+  for(int r : negative) {
+    folds[next % k].push_back(r);
+    next = next + 1;
+  }
+  for(auto &fold : folds) {
+    std::sort(fold.begin(), fold.end());
+  }
+  return folds;
+}
+
+// Every row that isn't in fold 'f'.
+static inline std::vector<int> fold_training_rows(const std::vector<std::vector<int> > &folds, size_t f) {
+  std::vector<int> rows;
+  for(size_t g = 0; g < folds.size(); ++g) {
+    if(g != f) {
+      rows.insert(rows.end(), folds[g].begin(), folds[g].end());
+    }
+  }
+  std::sort(rows.begin(), rows.end());
+  return rows;
+}
+
+struct SearchPoint {
+  double C;
+  std::vector<double> accuracy;
+  double seconds;
+  int passes;
+  unsigned int done;
+};
+
+static inline double mean_of(const std::vector<double> &v) {
+  double sum = 0.0;
+  for(double x : v) {
+    sum = sum + x;
+  }
+  return v.empty() ? 0.0 : sum / v.size();
+}
+
+static inline double stddev_of(const std::vector<double> &v) {
+  double mean = mean_of(v);
+  double sum = 0.0;
+  for(double x : v) {
+    sum = sum + (x - mean) * (x - mean);
+  }
+  return v.size() < 2 ? 0.0 : sqrt(sum / (v.size() - 1));
+}
+
+// Cross-validate every C of 'grid' over 'k' folds with the solver settings
+// of 'params', on at most 'threads' threads and within about 'budgetMB'
+// megabytes of solver state besides the training matrix. Returns the points
+// in grid order.
+static inline std::vector<SearchPoint> search_c(const cv::Mat &features, const cv::Mat &labels,
+                                                const SearchGrid &grid, unsigned int k, unsigned int threads,
+                                                size_t budgetMB, const DcdParams &params) {
+  std::vector<double> values = grid.values();
+  std::vector<SearchPoint> points(values.size());
+  for(size_t p = 0; p < points.size(); ++p) {
+    points[p].C = values[p];
+    points[p].accuracy.assign(k, 0.0);
+    points[p].seconds = 0.0;
+    points[p].passes = 0;
+    points[p].done = 0;
+  }
+
+  std::vector<std::vector<int> > folds = make_folds(labels, k, params.seed);
+  std::vector<std::vector<int> > training(k);
+  size_t foldBytes = 0;
+  size_t largest = 0;
+  for(unsigned int f = 0; f < k; ++f) {
+    training[f] = fold_training_rows(folds, f);
+    foldBytes = foldBytes + (training[f].size() + folds[f].size()) * sizeof(int);
+    largest = std::max(largest, training[f].size());
+  }
+
+  // Each run of the grid keeps the dual variables, diagonal, labels and
+  // order of its fold's rows, and the weights:
+  const size_t runBytes = largest * (2 * sizeof(double) + sizeof(signed char) + sizeof(int)) +
+                          (features.cols + 1) * (sizeof(double) + sizeof(float));
+  const size_t budget = budgetMB << 20;
+  size_t concurrent = budget > foldBytes ? (budget - foldBytes) / runBytes : 0;
+  if(concurrent == 0) {
+    fprintf(stderr, "The search needs %.1f MB; going over the %zu MB budget.\n",
+            (foldBytes + runBytes) / 1048576.0, budgetMB);
+    concurrent = 1;
+  }
+  concurrent = std::min(concurrent, (size_t)threads);
+  const size_t runs = std::max((size_t)1, std::min((concurrent + k - 1) / k, points.size()));
+  const size_t perRun = (points.size() + runs - 1) / runs;
+  concurrent = std::min(concurrent, runs * k);
+  fprintf(stderr, "Searching %zu values of C over %u folds, %zu at a time (%.1f MB each)...\n",
+          points.size(), k, concurrent, runBytes / 1048576.0);
+
+  std::mutex lock;
+  parallel_for(runs * k, concurrent, [&](size_t t) {
+    const size_t f = t % k;
+    const size_t first = (t / k) * perRun;
+    const size_t last = std::min(first + perRun, points.size());
+    std::vector<double> alpha;
+    std::vector<float> w;
+    double bias;
+    for(size_t p = first; p < last; ++p) {
+      TraceSpan span("search point");
+      DcdParams point = params;
+      point.C = points[p].C;
+      uint64_t start = stats_now();
+      DcdResult result = train_dcd(features, labels, training[f], point, w, bias, &alpha);
+      double seconds = (stats_now() - start) / 1e9;
+      double accuracy = linear_accuracy(features, labels, folds[f], w, bias);
+
+      std::lock_guard<std::mutex> hold(lock);
+      SearchPoint &sp = points[p];
+      sp.accuracy[f] = accuracy;
+      sp.seconds = sp.seconds + seconds;
+      sp.passes = sp.passes + result.passes;
+      sp.done = sp.done + 1;
+      if(sp.done == k) {
+        fprintf(stderr, "C = %-10g %6.2f%% accuracy (stddev %.2f%%), %5.1f passes per fold, %.2f s\n", sp.C,
+                mean_of(sp.accuracy) * 100.0, stddev_of(sp.accuracy) * 100.0, (double)sp.passes / k, sp.seconds);
+      }
+    }
+  }, "search");
+  return points;
+}
+
+struct FoldResult {
+  double accuracy;
+  double seconds;
+  int passes;
+};
+
+// Cross-validate the solver settings of 'params' over 'k' folds, training
+// up to 'threads' folds at once. Returns the folds in order.
+static inline std::vector<FoldResult> cross_validate(const cv::Mat &features, const cv::Mat &labels, unsigned int k,
+                                                     unsigned int threads, const DcdParams &params) {
+  std::vector<std::vector<int> > folds = make_folds(labels, k, params.seed);
+  std::vector<FoldResult> results(k);
+  parallel_for(k, threads, [&](size_t f) {
+    TraceSpan span("fold");
+    std::vector<int> training = fold_training_rows(folds, f);
+    std::vector<float> w;
+    double bias;
+    uint64_t start = stats_now();
+    DcdResult result = train_dcd(features, labels, training, params, w, bias);
+    results[f].seconds = (stats_now() - start) / 1e9;
+    results[f].passes = result.passes;
+    results[f].accuracy = linear_accuracy(features, labels, folds[f], w, bias);
+  }, "fold");
+  return results;
+}
+
+// The most accurate point; ties go to the smaller C, which generalizes
+// better and trains faster.
+static inline const SearchPoint &best_point(const std::vector<SearchPoint> &points) {
+  size_t best = 0;
+  for(size_t p = 1; p < points.size(); ++p) {
+    if(mean_of(points[p].accuracy) > mean_of(points[best].accuracy)) {
+      best = p;
+    }
+  }
+  return points[best];
+}
+
+#endif /* HT_SEARCH_HPP */
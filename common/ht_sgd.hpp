@@ -0,0 +1,278 @@
+#ifndef HT_SGD_HPP
+#define HT_SGD_HPP
+
+#include <math.h>
+#include <stdint.h>
+#include <algorithm>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "ht_dtype.hpp"
+#include "ht_feature_map.hpp"
+#include "ht_quantize.hpp"
+#include "ht_queue.hpp"
+#include "ht_stats.hpp"
+
+// A linear SVM trained straight off the features files, for sets too large
+// to load into memory (hog_trainer --solver sgd). It makes a few passes over
+// the files with Pegasos stochastic subgradient steps (Shalev-Shwartz et
+// al., "Pegasos: Primal Estimated sub-GrAdient SOlver for SVM", ICML 2007)
+// on the same objective as the C-SVM, and returns the average of the weights
+// seen during the later passes, which is much closer to the optimum than the
+// last weights are (Xu, "Towards Optimal One Pass Large Scale Learning with
+// Averaged Stochastic Gradient Descent", 2011).
+//
+// The files are read a block at a time (see MappedFeatures; open them with
+// ACCESS_STREAMED), in a fresh random order of blocks every pass. Training
+// draws rows at random from a few blocks at once, so that examples of both
+// classes (which come from different files) are mixed. A loader thread reads and decodes blocks
+// ahead of the training thread, handing them over through a small queue;
+// blocks are let go of as soon as they are decoded, so memory use is a few
+// blocks of floats whatever the size of the set.
+//
+// As with the dcd solver, the bias is learned as the weight of a feature
+// that is always 1.
+
+struct StreamSet {
+  const MappedFeatures *file;
+  const QuantizationTable *table;
+  float response;
+};
+
+struct SgdParams {
+  SgdParams() : C(0.01), passes(5), mix(4), prefetch(2), seed(1) {
+  }
+
+  double C;
+  unsigned int passes;
+  // Blocks rows are drawn from at once.
+  size_t mix;
+  // Decoded blocks the loader may get ahead of training.
+  unsigned int prefetch;
+  uint64_t seed;
+};
+
+struct SgdResult {
+  // Live (not tombstoned) rows.
+  uint64_t examples;
+  uint64_t steps;
+  bool corrupt;
+};
+
+// The live rows of one block, widened to floats.
+struct StreamBlock {
+  std::vector<float> rows;
+  size_t count;
+  float response;
+  bool ok;
+};
+
+typedef std::unique_ptr<StreamBlock> StreamBlockPtr;
+
+// The rows of 'file' that haven't been tombstoned, from its header alone,
+// so that no row is read before training starts.
+static inline uint64_t count_live_rows(const MappedFeatures &file) {
+  const FeatureHeader &header = file.header();
+  return header.rows - std::min(header.tombstoned, header.rows);
+}
+
+static inline SgdResult train_sgd(const std::vector<StreamSet> &sets, const SgdParams &params,
+                                  std::vector<float> &w, double &bias) {
+  struct Chunk {
+    size_t set;
+    uint64_t block;
+  };
+
+  SgdResult result;
+  result.examples = 0;
+  result.steps = 0;
+  result.corrupt = false;
+  std::vector<Chunk> chunks;
+  for(size_t s = 0; s < sets.size(); ++s) {
+    for(uint64_t b = 0; b < sets[s].file->blocks(); ++b) {
+      Chunk c;
+      c.set = s;
+      c.block = b;
+      chunks.push_back(c);
+    }
+    result.examples = result.examples + count_live_rows(*sets[s].file);
+  }
+  const int width = sets.empty() ? 0 : sets[0].file->header().width;
+  const double lambda = 1.0 / (params.C * std::max(result.examples, (uint64_t)1));
+
+  // Every pass visits the blocks in an order of its own:
+  std::mt19937_64 random(params.seed);
+  std::vector<Chunk> order;
+  for(unsigned int p = 0; p < params.passes; ++p) {
+    std::shuffle(chunks.begin(), chunks.end(), random);
+    order.insert(order.end(), chunks.begin(), chunks.end());
+  }
+
+  BoundedQueue<StreamBlockPtr> queue(params.prefetch, 1);
+  std::thread loader([&]() {
+    trace_thread_name("loader");
+    std::vector<char> scratch;
+    for(size_t k = 0; k < order.size(); ++k) {
+      if(k + 1 < order.size()) {
+        sets[order[k + 1].set].file->will_need_block(order[k + 1].block);
+      }
+      const StreamSet &set = sets[order[k].set];
+      const MappedFeatures &file = *set.file;
+      const FeatureHeader &header = file.header();
+      const uint64_t b = order[k].block;
+      StageTimer timer(STAT_LOAD, file.block_row_count(b) * header.rowStride, k);
+      StreamBlockPtr block(new StreamBlock());
+      block->response = set.response;
+      block->count = 0;
+      const char *rows = file.block(b, scratch);
+      block->ok = rows != NULL;
+      if(rows != NULL) {
+        block->rows.resize(file.block_row_count(b) * width);
+        for(uint64_t r = 0; r < file.block_row_count(b); ++r) {
+          const char *row = rows + r * header.rowStride;
+          if(is_tombstoned_row(row, header)) {
+            continue;
+          }
+          float *into = block->rows.data() + block->count * width;
+          if(header.dtype == FEATURE_U8) {
+            set.table->dequantize((const uint8_t *)row, into);
+          }
+          else {
+            widen_features(row, width, (FeatureType)header.dtype, into);
+          }
+          block->count = block->count + 1;
+        }
+      }
+      file.release_block(b);
+      queue.push(block);
+    }
+    queue.close();
+  });
+
+  // w = scale * v, so shrinking w is a single multiply. 'norm' tracks
+  // |v|^2 for the projection onto the ball of radius 1/sqrt(lambda), which
+  // the optimum lies within.
+  std::vector<double> v(width + 1, 0.0);
+  std::vector<double> average(width + 1, 0.0);
+  double scale = 1.0;
+  double norm = 0.0;
+  uint64_t averaged = 0;
+
+  // Rows are drawn at random from 'mix' blocks at a time, as every file
+  // holds the examples of one class only.
+  struct Open {
+    StreamBlockPtr block;
+    std::vector<uint32_t> order;
+    size_t next;
+  };
+  std::vector<Open> open;
+  uint64_t remaining = 0;
+  for(uint64_t batch = 0; ; ++batch) {
+    StreamBlockPtr block;
+    while(open.size() < params.mix && queue.pop(block)) {
+      if(!block->ok) {
+        result.corrupt = true;
+        continue;
+      }
+      if(block->count == 0) {
+        continue;
+      }
+      Open o;
+      o.order.resize(block->count);
+      for(size_t r = 0; r < o.order.size(); ++r) {
+        o.order[r] = r;
+      }
+      std::shuffle(o.order.begin(), o.order.end(), random);
+      o.next = 0;
+      o.block = std::move(block);
+      remaining = remaining + o.order.size();
+      open.push_back(std::move(o));
+    }
+    if(open.empty()) {
+      break;
+    }
+
+    // Train until a block runs out and another can be opened:
+    StageTimer timer(STAT_TRAIN, 0, batch);
+    size_t trained = 0;
+    for(bool exhausted = false; !exhausted; ) {
+      uint64_t pick = random() % remaining;
+      size_t o = 0;
+      while(pick >= open[o].order.size() - open[o].next) {
+        pick = pick - (open[o].order.size() - open[o].next);
+        o = o + 1;
+      }
+      Open &from = open[o];
+      const float *x = from.block->rows.data() + (size_t)from.order[from.next] * width;
+      const double y = from.block->response > 0 ? 1.0 : -1.0;
+      from.next = from.next + 1;
+      remaining = remaining - 1;
+      trained = trained + 1;
+
+      double dot = v[width];
+      double xx = 1.0;
+      for(int d = 0; d < width; ++d) {
+        dot = dot + v[d] * x[d];
+        xx = xx + (double)x[d] * x[d];
+      }
+      result.steps = result.steps + 1;
+      const double eta = 1.0 / (lambda * result.steps);
+
+      const double margin = y * scale * dot;
+      scale = scale * (1.0 - eta * lambda);
+      if(scale <= 0.0) {
+        // The first step throws the (zero) starting point away entirely.
+        std::fill(v.begin(), v.end(), 0.0);
+        scale = 1.0;
+        norm = 0.0;
+        dot = 0.0;
+      }
+      if(margin < 1.0) {
+        const double step = eta * y / scale;
+        for(int d = 0; d < width; ++d) {
+          v[d] = v[d] + step * x[d];
+        }
+        v[width] = v[width] + step;
+        norm = norm + 2.0 * step * dot + step * step * xx;
+      }
+      const double length = scale * sqrt(std::max(norm, 0.0));
+      if(length * sqrt(lambda) > 1.0) {
+        scale = scale / (length * sqrt(lambda));
+      }
+      if(scale < 1e-9) {
+        for(double &e : v) {
+          e = e * scale;
+        }
+        norm = norm * scale * scale;
+        scale = 1.0;
+      }
+
+      // Average over every pass but the first, unless there is only one:
+      if(params.passes == 1 || result.steps > result.examples) {
+        averaged = averaged + 1;
+        const double mix = 1.0 / averaged;
+        for(int d = 0; d <= width; ++d) {
+          average[d] = average[d] + (scale * v[d] - average[d]) * mix;
+        }
+      }
+
+      if(from.next == from.order.size()) {
+        open.erase(open.begin() + o);
+        exhausted = true;
+      }
+    }
+    timer.set_bytes(trained * width * sizeof(float));
+  }
+  loader.join();
+
+  w.resize(width);
+  for(int d = 0; d < width; ++d) {
+    w[d] = average[d];
+  }
+  bias = average[width];
+  return result;
+}
+
+#endif /* HT_SGD_HPP */
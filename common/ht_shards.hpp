@@ -0,0 +1,112 @@
+#ifndef HT_SHARDS_HPP
+#define HT_SHARDS_HPP
+
+#include <stdio.h>
+#include <string.h>
+#include <glob.h>
+#include <string>
+#include <vector>
+
+// Sharded features files. hog_snort --shards <n> writes a features file as n
+// ordinary HOGSNRT files named after it ("features.bin" becomes
+// "features-00000-of-00016.bin" and so on), each written by its own thread,
+// plus a small text list of them at the path of the features file itself:
+//
+//   HOGSNRT-SHARDS 1
+//   <shard file name, relative to the directory of the list>
+//   ...
+//
+// Row r of the whole set is row r / n of shard r % n, so rows keep stable
+// numbers across --append runs. The readers take a shard list, a quoted
+// wildcard pattern or a plain features file wherever a features file goes.
+
+const char HOGSNRT_SHARDS_MAGIC[] = "HOGSNRT-SHARDS 1\n";
+
+static inline std::string shard_path_for(const std::string &path, unsigned int shard, unsigned int count) {
+  size_t slash = path.rfind('/');
+  size_t dot = path.rfind('.');
+  if(dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+    dot = path.size();
+  }
+  char suffix[64];
+  snprintf(suffix, sizeof(suffix), "-%05u-of-%05u", shard, count);
+  return path.substr(0, dot) + suffix + path.substr(dot);
+}
+
+static inline std::string directory_of(const std::string &path) {
+  size_t slash = path.rfind('/');
+  return slash == std::string::npos ? std::string() : path.substr(0, slash + 1);
+}
+
+// The shards listed at 'path', as paths usable from the current directory;
+// false if 'path' isn't a shard list.
+static inline bool load_shard_list(const std::string &path, std::vector<std::string> &into) {
+  FILE *f = fopen(path.c_str(), "r");
+  if(f == NULL) {
+    return false;
+  }
+  char line[8192];
+  if(fgets(line, sizeof(line), f) == NULL || strcmp(line, HOGSNRT_SHARDS_MAGIC) != 0) {
+    fclose(f);
+    return false;
+  }
+  std::string directory = directory_of(path);
+  into.clear();
+  while(fgets(line, sizeof(line), f) != NULL) {
+    std::string name(line);
+    if(!name.empty() && name.back() == '\n') {
+      name.pop_back();
+    }
+    if(!name.empty()) {
+      into.push_back(name[0] == '/' ? name : directory + name);
+    }
+  }
+  fclose(f);
+  return true;
+}
+
+// Write the list through a temporary file, like the manifest.
+static inline bool save_shard_list(const std::string &path, const std::vector<std::string> &shards) {
+  std::string tempPath = path + ".tmp";
+  FILE *f = fopen(tempPath.c_str(), "w");
+  if(f == NULL) {
+    return false;
+  }
+  std::string directory = directory_of(path);
+  fputs(HOGSNRT_SHARDS_MAGIC, f);
+  for(auto &shard : shards) {
+    bool local = !directory.empty() && shard.compare(0, directory.size(), directory) == 0;
+    fprintf(f, "%s\n", local ? shard.c_str() + directory.size() : shard.c_str());
+  }
+  if(fclose(f) != 0) {
+    remove(tempPath.c_str());
+    return false;
+  }
+  return rename(tempPath.c_str(), path.c_str()) == 0;
+}
+
+// The features files named by a command line argument: the shards of a shard
+// list, the files matching a wildcard pattern (in sorted order), or the
+// argument itself.
+static inline std::vector<std::string> expand_feature_paths(const std::string &spec) {
+  std::vector<std::string> paths;
+  if(load_shard_list(spec, paths)) {
+    return paths;
+  }
+  if(spec.find_first_of("*?[") != std::string::npos) {
+    glob_t matches;
+    if(glob(spec.c_str(), 0, NULL, &matches) == 0) {
+      for(size_t i = 0; i < matches.gl_pathc; ++i) {
+        paths.push_back(matches.gl_pathv[i]);
+      }
+    }
+    globfree(&matches);
+    if(!paths.empty()) {
+      return paths;
+    }
+  }
+  paths.push_back(spec);
+  return paths;
+}
+
+#endif /* HT_SHARDS_HPP */
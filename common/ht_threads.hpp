@@ -0,0 +1,48 @@
+#ifndef HT_THREADS_HPP
+#define HT_THREADS_HPP
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include "ht_trace.hpp"
+
+// Resolve a user-supplied thread count; 0 means "one per core".
+static unsigned int resolve_thread_count(unsigned int requested) {
+  if(requested > 0) {
+    return requested;
+  }
+  unsigned int cores = std::thread::hardware_concurrency();
+  return cores > 0 ? cores : 1;
+}
+
+// Calls work(i) for every i in [0, count) on 'threads' threads, including
+// the calling one, handing out indices in order as threads become free. The
+// other threads show up as 'name' in a --trace.
+static inline void parallel_for(size_t count, unsigned int threads, std::function<void(size_t)> work,
+                                const char *name = "worker") {
+  std::atomic<size_t> next(0);
+  auto run = [&]() {
+    size_t i;
+    while((i = next.fetch_add(1)) < count) {
+      work(i);
+    }
+  };
+
+  std::vector<std::thread> pool;
+  for(unsigned int t = 1; t < threads && t < count; ++t) {
+    pool.push_back(std::thread([&]() {
+      trace_thread_name(name);
+      run();
+    }));
+  }
+  run();
+  for(auto &t : pool) {
+    t.join();
+  }
+}
+
+#endif /* HT_THREADS_HPP */
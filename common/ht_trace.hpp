@@ -0,0 +1,227 @@
+#ifndef HT_TRACE_HPP
+#define HT_TRACE_HPP
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// A timeline of the tools' work (--trace <file>), in the Chrome trace event
+// format that chrome://tracing and ui.perfetto.dev open. Every StageTimer
+// (see ht_stats.hpp) and TraceSpan becomes a span on the lane of the thread
+// that ran it, so stalls in the pipeline and threads waiting on each other
+// show up as gaps.
+//
+// Spans go into a fixed-size ring buffer of the thread's own, which costs a
+// thread_local lookup and a few stores, and nothing at all without --trace.
+// When a thread exits, its buffer is handed to the next thread started under
+// the same name, so threads that come and go (parallel_for starts new ones
+// every call) share one lane per name at a time instead of each keeping a
+// buffer. When a lane records more than HT_TRACE_EVENTS_PER_THREAD spans, its
+// oldest ones are overwritten, and the number lost is reported.
+
+const size_t HT_TRACE_EVENTS_PER_THREAD = 1 << 16;
+const uint64_t HT_TRACE_NO_ITEM = ~(uint64_t)0;
+
+static inline uint64_t trace_now(void) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct TraceEvent {
+  const char *name;
+  uint64_t start;
+  uint64_t end;
+  uint64_t item;
+  uint64_t bytes;
+};
+
+struct TraceBuffer {
+  TraceBuffer() : name("thread"), lane(0), recorded(0), idle(false),
+                  events(new TraceEvent[HT_TRACE_EVENTS_PER_THREAD]) {
+  }
+
+  const char *name;
+  unsigned int lane;
+  uint64_t recorded;
+  // Whether the thread that recorded into it has exited.
+  bool idle;
+  std::unique_ptr<TraceEvent[]> events;
+};
+
+class TraceLog {
+public:
+  static TraceLog &get() {
+    static TraceLog log;
+    return log;
+  }
+
+  bool enabled() const {
+    return on.load(std::memory_order_relaxed);
+  }
+
+  void enable() {
+    origin = trace_now();
+    on.store(true);
+  }
+
+  // The calling thread's buffer; the first call takes an idle buffer named
+  // 'name' if there is one.
+  TraceBuffer *thread_buffer(const char *name = "thread") {
+    static thread_local ThreadBuffer mine;
+    if(mine.buffer == NULL) {
+      std::lock_guard<std::mutex> hold(lock);
+      for(auto &b : buffers) {
+        if(b->idle && strcmp(b->name, name) == 0) {
+          mine.buffer = b.get();
+          break;
+        }
+      }
+      if(mine.buffer == NULL) {
+        buffers.emplace_back(new TraceBuffer());
+        mine.buffer = buffers.back().get();
+        mine.buffer->lane = buffers.size();
+        mine.buffer->name = name;
+      }
+      mine.buffer->idle = false;
+    }
+    return mine.buffer;
+  }
+
+  // Write every thread's spans to 'path'. Only call this once the threads
+  // that recorded anything are done.
+  bool write(const char *tool, const std::string &path) {
+    std::lock_guard<std::mutex> hold(lock);
+    FILE *f = fopen(path.c_str(), "w");
+    if(f == NULL) {
+      fprintf(stderr, "Couldn't write trace to '%s'.\n", path.c_str());
+      return false;
+    }
+    fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    fprintf(f, "{\"ph\": \"M\", \"pid\": 1, \"tid\": 0, \"name\": \"process_name\", \"args\": {\"name\": \"%s\"}}",
+            tool);
+    uint64_t lost = 0;
+    for(auto &b : buffers) {
+      fprintf(f, ",\n{\"ph\": \"M\", \"pid\": 1, \"tid\": %u, \"name\": \"thread_name\", "
+                 "\"args\": {\"name\": \"%s %u\"}}", b->lane, b->name, b->lane);
+      fprintf(f, ",\n{\"ph\": \"M\", \"pid\": 1, \"tid\": %u, \"name\": \"thread_sort_index\", "
+                 "\"args\": {\"sort_index\": %u}}", b->lane, b->lane);
+      uint64_t first = 0;
+      if(b->recorded > HT_TRACE_EVENTS_PER_THREAD) {
+        first = b->recorded - HT_TRACE_EVENTS_PER_THREAD;
+        lost = lost + first;
+      }
+      for(uint64_t i = first; i < b->recorded; ++i) {
+        const TraceEvent &e = b->events[i % HT_TRACE_EVENTS_PER_THREAD];
+        fprintf(f, ",\n{\"ph\": \"X\", \"pid\": 1, \"tid\": %u, \"name\": \"%s\", \"ts\": %.3f, \"dur\": %.3f",
+                b->lane, e.name, (double)(int64_t)(e.start - origin) / 1e3, (e.end - e.start) / 1e3);
+        if(e.item != HT_TRACE_NO_ITEM) {
+          fprintf(f, ", \"args\": {\"item\": %llu, \"bytes\": %llu}}", (unsigned long long)e.item,
+                  (unsigned long long)e.bytes);
+        }
+        else {
+          fprintf(f, ", \"args\": {\"bytes\": %llu}}", (unsigned long long)e.bytes);
+        }
+      }
+    }
+    fprintf(f, "\n]}\n");
+    if(fclose(f) != 0) {
+      fprintf(stderr, "Couldn't write trace to '%s'.\n", path.c_str());
+      return false;
+    }
+    if(lost > 0) {
+      fprintf(stderr, "The trace is missing the %llu oldest spans of its busiest threads.\n",
+              (unsigned long long)lost);
+    }
+    return true;
+  }
+
+private:
+  // Hands a thread's buffer back when it exits.
+  struct ThreadBuffer {
+    ThreadBuffer() : buffer(NULL) {
+    }
+
+    ~ThreadBuffer() {
+      if(buffer != NULL) {
+        TraceLog::get().release(buffer);
+      }
+    }
+
+    TraceBuffer *buffer;
+  };
+
+  TraceLog() : on(false), origin(0) {
+  }
+
+  void release(TraceBuffer *b) {
+    std::lock_guard<std::mutex> hold(lock);
+    b->idle = true;
+  }
+
+  std::atomic<bool> on;
+  uint64_t origin;
+  std::mutex lock;
+  std::vector<std::unique_ptr<TraceBuffer> > buffers;
+};
+
+// Record a span named 'name' (a string literal) on the calling thread's lane.
+// 'item' is the image or row the work was for, if there is one.
+static inline void trace_span(const char *name, uint64_t start, uint64_t end, uint64_t item = HT_TRACE_NO_ITEM,
+                              uint64_t bytes = 0) {
+  TraceLog &log = TraceLog::get();
+  if(!log.enabled()) {
+    return;
+  }
+  TraceBuffer *b = log.thread_buffer();
+  TraceEvent &e = b->events[b->recorded % HT_TRACE_EVENTS_PER_THREAD];
+  e.name = name;
+  e.start = start;
+  e.end = end;
+  e.item = item;
+  e.bytes = bytes;
+  b->recorded = b->recorded + 1;
+}
+
+// Name the calling thread's lane (a string literal, such as "decoder").
+static inline void trace_thread_name(const char *name) {
+  TraceLog &log = TraceLog::get();
+  if(log.enabled()) {
+    log.thread_buffer(name)->name = name;
+  }
+}
+
+// Start recording; call before any worker threads are started.
+static inline void trace_start(void) {
+  TraceLog::get().enable();
+  trace_thread_name("main");
+}
+
+static inline bool trace_write(const char *tool, const std::string &path) {
+  return TraceLog::get().write(tool, path);
+}
+
+// Traces the scope it lives in, for work that isn't a stage of its own, such
+// as the phases of training.
+class TraceSpan {
+public:
+  explicit TraceSpan(const char *name) : name(name), start(TraceLog::get().enabled() ? trace_now() : 0) {
+  }
+
+  ~TraceSpan() {
+    if(start != 0) {
+      trace_span(name, start, trace_now());
+    }
+  }
+
+private:
+  const char *name;
+  uint64_t start;
+};
+
+#endif /* HT_TRACE_HPP */
@@ -0,0 +1,127 @@
+#ifndef HT_WINDOWS_HPP
+#define HT_WINDOWS_HPP
+
+#include <stdint.h>
+#include <string.h>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+#include "ht_hog.hpp"
+
+// Many training windows out of one image (hog_snort --windows). Negatives are
+// usually sampled from background images far larger than the detection
+// window, and cutting those into window-sized files computes the gradients
+// and histograms of every overlapping pixel again for every crop. Instead the
+// image is decoded once at full size, the block histograms of the whole image
+// are computed once (TrainerHogKernel lays them out column by column, just as
+// in a descriptor), and every window is put together from them with one copy
+// per column of blocks.
+//
+// Windows start on block stride (8 pixel) boundaries, or on a coarser grid
+// given by 'stride'. With a 'count', that many of the windows on the grid are
+// picked at random, seeded by 'seed' and a hash of the image file's content,
+// so an image gives the same windows whatever its name, the number of threads
+// or the processing order, and the feature cache (keyed by content) agrees
+// with a fresh run. Without one, every window on the grid is taken, up to
+// MaxWindows; larger grids are sampled like a count of MaxWindows, since an
+// image's windows travel through the pipeline together.
+//
+// Tolerance: blocks at the edge of a window see the pixels around it, as in
+// cv::HOGDescriptor::detectMultiScale(), where a window cropped to a file of
+// its own would reflect its border pixels instead; only the gradients of the
+// outermost pixel rows and columns of a window differ.
+class WindowSampler {
+public:
+  enum {
+    MaxWindows = 1024
+  };
+
+  WindowSampler(cv::Size window, unsigned int count, unsigned int stride, uint64_t seed)
+      : window(window), count(count), stride(stride), seed(seed) {
+  }
+
+  bool supported() const {
+    return TrainerHogKernel::supports(window) && stride > 0 && stride % HogExtractor::BlockStride == 0;
+  }
+
+  // The part of 'image' that tiles evenly into blocks: its top left corner,
+  // less at most BlockStride - 1 columns and rows. Empty if it is smaller
+  // than the window.
+  cv::Mat tileable(const cv::Mat &image) const {
+    if(image.cols < window.width || image.rows < window.height) {
+      return cv::Mat();
+    }
+    int width = image.cols - (image.cols - HogExtractor::BlockSize) % HogExtractor::BlockStride;
+    int height = image.rows - (image.rows - HogExtractor::BlockSize) % HogExtractor::BlockStride;
+    return image(cv::Rect(0, 0, width, height));
+  }
+
+  // The top left corners, in blocks, of the windows to take from the image
+  // whose file hashes to 'content', once it is tileable() to 'size'.
+  void positions(uint64_t content, cv::Size size, std::vector<cv::Point> &into) const {
+    into.clear();
+    if(size.width < window.width || size.height < window.height) {
+      return;
+    }
+    const cv::Size grid = TrainerHogKernel::block_grid(size);
+    const cv::Size windowGrid = TrainerHogKernel::block_grid(window);
+    const int step = stride / HogExtractor::BlockStride;
+    const size_t across = (grid.width - windowGrid.width) / step + 1;
+    const size_t down = (grid.height - windowGrid.height) / step + 1;
+    const size_t total = across * down;
+    const size_t wanted = count == 0 || count > MaxWindows ? MaxWindows : count;
+
+    if(wanted >= total) {
+      for(size_t i = 0; i < total; ++i) {
+        into.push_back(cv::Point((i / down) * step, (i % down) * step));
+      }
+      return;
+    }
+
+    // Floyd's algorithm picks 'count' distinct windows in 'count' draws, and
+    // the set keeps them in descriptor (column by column) order:
+    std::mt19937_64 random(seed ^ content);
+    std::set<size_t> picked;
+    for(size_t j = total - wanted; j < total; ++j) {
+      size_t t = random() % (j + 1);
+      if(!picked.insert(t).second) {
+        picked.insert(j);
+      }
+    }
+    for(size_t i : picked) {
+      into.push_back(cv::Point((i / down) * step, (i % down) * step));
+    }
+  }
+
+  // Put the descriptor of the window at block 'at' together at 'out', from
+  // the block histograms 'blocks' of an image of 'size'.
+  void assemble(const std::vector<float> &blocks, cv::Size size, cv::Point at, float *out) const {
+    const cv::Size grid = TrainerHogKernel::block_grid(size);
+    const cv::Size windowGrid = TrainerHogKernel::block_grid(window);
+    const size_t column = (size_t)windowGrid.height * TrainerHogKernel::BlockHistogramSize;
+    for(int bx = 0; bx < windowGrid.width; ++bx) {
+      const float *from = blocks.data() + ((size_t)(at.x + bx) * grid.height + at.y) * TrainerHogKernel::BlockHistogramSize;
+      memcpy(out + bx * column, from, column * sizeof(float));
+    }
+  }
+
+  // Everything besides the image that determines which windows are taken,
+  // for the feature cache.
+  std::string signature() const {
+    std::ostringstream s;
+    s << "windows=" << count << " stride=" << stride << " seed=" << seed << " max=" << (int)MaxWindows << " by=content";
+    return s.str();
+  }
+
+private:
+  cv::Size window;
+  unsigned int count;
+  unsigned int stride;
+  uint64_t seed;
+};
+
+#endif /* HT_WINDOWS_HPP */
@@ -8,8 +8,19 @@
 #include <memory>
 #include <opencv2/opencv.hpp>
 
+#include "../common/ht_cache.hpp"
 #include "../common/ht_common.hpp"
-#include "../common/ht_image_paths.hpp"
+#include "../common/ht_decode.hpp"
+#include "../common/ht_dtype.hpp"
+#include "../common/ht_feature_map.hpp"
+#include "../common/ht_hog.hpp"
+#include "../common/ht_image_source.hpp"
+#include "../common/ht_io_order.hpp"
+#include "../common/ht_linear.hpp"
+#include "../common/ht_quantize.hpp"
+#include "../common/ht_shards.hpp"
+#include "../common/ht_stats.hpp"
+#include "../common/ht_threads.hpp"
 
 using namespace cv;
 using namespace std;
@@ -19,10 +30,17 @@ const option::Descriptor usage[] =
   {UNKNOWN, 0, "", "", Arg::Unknown, "USAGE: hog_run [options] svm_file\n\n"
                                      "Options:" },
   {HELP, 0, "", "help", Arg::None, "  --help  \t\tPrint this text." },
-  {POS_PATH, 0, "p", "pos", Arg::Path, "  --pos <path>, \t-p <path>  \tSpecifies the positive test images path."},
-  {NEG_PATH, 0, "n", "neg", Arg::Path, "  --neg <path>, \t-n <path>  \tSpecifies the negative test images path."},
+  {POS_PATH, 0, "p", "pos", Arg::Path, "  --pos <path>, \t-p <path>  \tSpecifies the positive test images directory, tar or zip archive, or a features file, shard list or quoted wildcard pattern of features files."},
+  {NEG_PATH, 0, "n", "neg", Arg::Path, "  --neg <path>, \t-n <path>  \tSpecifies the negative test images directory, tar or zip archive, or a features file, shard list or quoted wildcard pattern of features files."},
   {SIZE_X, 0, "x", "", Arg::Numeric, "  -x <n>  \t\tSpecifies an X height for the test images in pixels (default: 64)."},
   {SIZE_Y, 0, "y", "", Arg::Numeric, "  -y <n>  \t\tSpecifies a Y height for the test images in pixels (default: 128)."},
+  {CACHE_DIR, 0, "", "cache", Arg::Path, "  --cache <dir>  \t\tReuse and store features in a cache directory shared between runs and tools."},
+  {CACHE_SIZE, 0, "", "cache-size", Arg::Numeric, "  --cache-size <MB>  \t\tSpecifies the size cap for the feature cache in megabytes (default: 1024)."},
+  {ORDER, 0, "", "order", Arg::Path, "  --order <mode>  \t\tProcesses images in 'path', 'inode' or on-disk 'extent' order (default: path)."},
+  {PREFETCH, 0, "", "prefetch", Arg::Numeric, "  --prefetch <n>  \t\tAsks the kernel to read ahead this many images before they are needed (default: 0)."},
+  {THREADS, 0, "t", "threads", Arg::Count, "  --threads <n>, \t-t <n>  \tSpecifies the number of features files (shards) tested at once; 0 uses every core (default: 0)."},
+  {STATS_JSON, 0, "", "stats-json", Arg::Path, "  --stats-json <file>  \t\tAlso writes the per-stage timings and throughput printed at exit to a JSON file."},
+  {TRACE, 0, "", "trace", Arg::Path, "  --trace <file>  \t\tWrites a timeline of every thread's work in the Chrome trace event format, for chrome://tracing or ui.perfetto.dev."},
   {0, 0, 0, 0, 0, 0}
 };
 
@@ -58,34 +76,102 @@ string svm_kernel_as_string(int svm_kernel) {
   }
 }
 
-unsigned int process_images(vector<string>& imagePaths,
-                        unsigned int size_x, unsigned int size_y, CvSVM &svm,
-                        bool positive) {
-  unsigned int row = 0;
+// Classify the images of 'stream'; 'seen' is set to the number of images in
+// it, and 'tested' to the number classified, which leaves out any that
+// couldn't be read. Linear models are collapsed into a single weight vector
+// first, so each image costs one dot product rather than one per support
+// vector.
+unsigned int process_images(ImageStream& stream,
+                        unsigned int size_x, unsigned int size_y, LinearSVM &svm,
+                        bool positive, const FeatureCache *cache,
+                        size_t &seen, size_t &tested) {
   unsigned int misclassified = 0;
-  auto totalPaths = imagePaths.size();
+  seen = 0;
+  tested = 0;
+  HogExtractor hog(Size(size_x, size_y));
+  StreamedImage input;
+  vector<uchar> &bytes = input.bytes;
+  vector<float> v;
+  vector<float> w;
+  double bias = 0.0;
+  bool linear = svm.collapse(w, bias);
+  // Archive positions are in bytes; scale them down to fit progress():
+  const unsigned long long step = stream.total() / 10000 + 1;
+  const unsigned int end = stream.total() / step + (stream.counted() ? 0 : 1);
 
   saveCursor();
-  for(auto path : imagePaths) {
+  for(size_t i = 0; ; ++i) {
+    bool more;
+    {
+      StageTimer timer(STAT_READ, 0, i);
+      more = stream.next(input);
+      timer.set_bytes(bytes.size());
+    }
+    if(!more) {
+      break;
+    }
+    seen = seen + 1;
+    const char *path = input.name.c_str();
     restoreCursor();
     if(positive) {
-      progress(row, totalPaths, "Testing against positive images...");
+      progress(input.position / step, end, "Testing against positive images...");
     }
     else {
-      progress(row, totalPaths, "Testing against negative images...");
+      progress(input.position / step, end, "Testing against negative images...");
     }
 
-    // Load the image and convert it to grayscale in one step:
-    auto image = imread(path, CV_LOAD_IMAGE_GRAYSCALE);
-    resize(image, image, Size(size_x, size_y));
+    if(!input.ok) {
+      fprintf(stderr, "\nCouldn't read image '%s', skipping...\n", path);
+      saveCursor();
+      continue;
+    }
 
-    HOGDescriptor hog(Size(size_x, size_y), Size(16, 16), Size(8, 8), Size(8, 8), 9);
-    vector<float> v;
-    vector<Point> l;
-    hog.compute(image, v, Size(0,0), Size(0,0), l);
+    CacheKey key;
+    bool cached = false;
+    if(cache != NULL) {
+      StageTimer timer(STAT_CACHE, 0, i);
+      key = cache->key_for(bytes);
+      cached = cache->lookup(key, v);
+    }
+    if(!cached) {
+      // Load the image and convert it to grayscale in one step, decoding at a
+      // reduced scale where the format allows it:
+      Mat image;
+      {
+        StageTimer timer(STAT_DECODE, bytes.size(), i);
+        image = decode_grayscale(bytes, Size(size_x, size_y));
+      }
+      if(image.empty()) {
+        fprintf(stderr, "\nCouldn't read image '%s', skipping...\n", path);
+        saveCursor();
+        continue;
+      }
+      {
+        StageTimer timer(STAT_RESIZE, 0, i);
+        resize(image, image, Size(size_x, size_y));
+      }
 
-    Mat fm = Mat(v);
-    int result = svm.predict(fm);
+      {
+        StageTimer timer(STAT_HOG, 0, i);
+        hog.compute(image, v);
+      }
+      if(cache != NULL) {
+        StageTimer timer(STAT_CACHE, 0, i);
+        cache->store(key, v);
+      }
+    }
+
+    int result;
+    {
+      StageTimer timer(STAT_PREDICT, 0, i);
+      if(linear) {
+        result = linear_score(w, bias, v.data()) >= 0.0 ? 1 : -1;
+      }
+      else {
+        Mat fm = Mat(v);
+        result = svm.predict(fm);
+      }
+    }
     // Assume we're using a classification (not regression) model; thus
     // with returnDLVal = false, 1 is a positive label and -1 is a negative label.
     if(positive && result == -1) {
@@ -94,26 +180,189 @@ unsigned int process_images(vector<string>& imagePaths,
     else if(!positive && result == 1) {
       misclassified = misclassified + 1;
     }
-
-    row = row + 1;
-    // 'image' should be released here as it falls out of scope...
+    tested = tested + 1;
   }
   fprintf(stderr, " Done.\n");
 
   return misclassified;
 }
 
+// Classify the rows of a features file written by hog_snort, skipping
+// tombstoned rows; 'tested' is set to the number of rows classified. Linear
+// models are evaluated as a single dot product per row, done in integers on
+// quantized rows. Files tested alongside others don't show progress.
+unsigned int process_features(const MappedFeatures &file, const LinearSVM &svm, bool positive, bool show_progress,
+                              size_t &tested) {
+  const FeatureHeader &header = file.header();
+  unsigned int misclassified = 0;
+  tested = 0;
+
+  vector<float> w;
+  double bias = 0.0;
+  bool linear = svm.collapse(w, bias);
+  QuantizationTable table;
+  unique_ptr<QuantizedLinearModel> quantized;
+  if(header.dtype == FEATURE_U8) {
+    table = QuantizationTable(header, file.data());
+    if(linear) {
+      quantized.reset(new QuantizedLinearModel(w, bias, table));
+    }
+  }
+
+  vector<float> v(header.width);
+  vector<char> scratch;
+  if(show_progress) {
+    saveCursor();
+  }
+  for(uint64_t b = 0; b < file.blocks(); ++b) {
+    if(show_progress) {
+      restoreCursor();
+      if(positive) {
+        progress(b, file.blocks(), "Testing against positive examples...");
+      }
+      else {
+        progress(b, file.blocks(), "Testing against negative examples...");
+      }
+    }
+
+    const char *rows;
+    {
+      StageTimer timer(STAT_LOAD, file.block_row_count(b) * header.rowStride, b);
+      rows = file.block(b, scratch);
+    }
+    if(rows == NULL) {
+      fprintf(stderr, "\nCorrupt block of examples, skipping...\n");
+      if(show_progress) {
+        saveCursor();
+      }
+      continue;
+    }
+    for(uint64_t r = 0; r < file.block_row_count(b); ++r) {
+      const char *row = rows + r * header.rowStride;
+      if(is_tombstoned_row(row, header)) {
+        continue;
+      }
+      StageTimer timer(STAT_PREDICT);
+      int result;
+      if(quantized) {
+        result = quantized->score((const uint8_t *)row) >= 0.0 ? 1 : -1;
+      }
+      else {
+        if(header.dtype == FEATURE_U8) {
+          table.dequantize((const uint8_t *)row, v.data());
+        }
+        else {
+          widen_features(row, header.width, (FeatureType)header.dtype, v.data());
+        }
+        if(linear) {
+          result = linear_score(w, bias, v.data()) >= 0.0 ? 1 : -1;
+        }
+        else {
+          Mat fm = Mat(v);
+          result = svm.predict(fm);
+        }
+      }
+      if(positive && result == -1) {
+        misclassified = misclassified + 1;
+      }
+      else if(!positive && result == 1) {
+        misclassified = misclassified + 1;
+      }
+      tested = tested + 1;
+    }
+  }
+  if(show_progress) {
+    fprintf(stderr, " Done.\n");
+  }
+
+  return misclassified;
+}
+
+// Open 'path' to test against if it is a features file that fits the model;
+// returns false if it isn't one (or is unusable), saying why in 'error'.
+bool open_test_features(MappedFeatures &file, const string &path, const LinearSVM &svm, bool positive,
+                        const char **error) {
+  if(!file.open(path, error)) {
+    return false;
+  }
+  const FeatureHeader &header = file.header();
+  const char *label = positive ? "positive" : "negative";
+  if(header.width != (uint64_t)svm.get_var_count()) {
+    *error = "wrong number of features";
+    fprintf(stderr, "The %s features file '%s' has %llu features per example, but the model expects %d.\n",
+            label, path.c_str(), (unsigned long long)header.width, svm.get_var_count());
+    return false;
+  }
+  fprintf(stderr, "Using %s test features from '%s' (%llu examples, %s elements%s)...\n", label, path.c_str(),
+          (unsigned long long)header.rows, feature_type_name(header.dtype), file.compressed() ? ", compressed" : "");
+  return true;
+}
+
+// Test every features file 'spec' names: a features file, a shard list or a
+// wildcard pattern. False if the first of them isn't a features file, in
+// which case 'spec' is taken to hold images. A file after the first that
+// can't be used sets 'failed', as the set it belongs to is incomplete. The
+// files are all opened first, then tested on 'threads' threads, each with
+// counts of its own that are summed once all of them are done.
+bool test_features_files(const string &spec, const LinearSVM &svm, bool positive, unsigned int threads,
+                         unsigned int &misclassified, size_t &tested, bool &failed) {
+  vector<string> paths = expand_feature_paths(spec);
+  misclassified = 0;
+  tested = 0;
+  failed = false;
+  vector<unique_ptr<MappedFeatures> > files;
+  for(size_t i = 0; i < paths.size(); ++i) {
+    const char *error = "";
+    files.emplace_back(new MappedFeatures());
+    if(!open_test_features(*files.back(), paths[i], svm, positive, &error)) {
+      if(i == 0) {
+        return false;
+      }
+      fprintf(stderr, "Couldn't use %s features file '%s' (%s).\n", positive ? "positive" : "negative",
+              paths[i].c_str(), error);
+      failed = true;
+      return true;
+    }
+  }
+
+  vector<unsigned int> wrong(files.size(), 0);
+  vector<size_t> counts(files.size(), 0);
+  const bool single = files.size() == 1;
+  if(!single) {
+    fprintf(stderr, "Testing against %zu %s features files...", files.size(), positive ? "positive" : "negative");
+  }
+  parallel_for(files.size(), threads, [&](size_t i) {
+    wrong[i] = process_features(*files[i], svm, positive, single, counts[i]);
+  }, "tester");
+  if(!single) {
+    fprintf(stderr, " Done.\n");
+  }
+  for(size_t i = 0; i < files.size(); ++i) {
+    misclassified = misclassified + wrong[i];
+    tested = tested + counts[i];
+  }
+  return true;
+}
+
 int main(int argc, char* argv[]) {
   argc -= (argc>0); argv += (argc>0); // Skip argv[0] if present.
   option::Stats stats(usage, argc, argv);
   unique_ptr<option::Option> options(new option::Option[stats.options_max]);
   unique_ptr<option::Option> buffer(new option::Option[stats.buffer_max]);
   option::Parser parse(usage, argc, argv, options.get(), buffer.get());
+  stats_start();
 
   string pos_dir = "pos";
   string neg_dir = "neg";
   unsigned int image_x = 64;
   unsigned int image_y = 128;
+  string cache_dir;
+  unsigned int cache_mb = HT_CACHE_DEFAULT_MB;
+  PathOrder order = ORDER_PATH;
+  size_t prefetch = 0;
+  unsigned int threads = 0;
+  string stats_path;
+  string trace_path;
 
   if(parse.error()) {
     return 1;
@@ -143,9 +392,54 @@ int main(int argc, char* argv[]) {
     istringstream(y_str) >> image_y;
   }
 
+  if(options.get()[CACHE_DIR]) {
+    cache_dir = options.get()[CACHE_DIR].last()->arg;
+  }
+
+  if(options.get()[CACHE_SIZE]) {
+    string c_str = options.get()[CACHE_SIZE].last()->arg;
+    istringstream(c_str) >> cache_mb;
+  }
+
+  if(options.get()[ORDER] && !parse_path_order(options.get()[ORDER].last()->arg, order)) {
+    fprintf(stderr, "Unknown processing order '%s'.\n", options.get()[ORDER].last()->arg);
+    return 1;
+  }
+
+  if(options.get()[PREFETCH]) {
+    string f_str = options.get()[PREFETCH].last()->arg;
+    istringstream(f_str) >> prefetch;
+  }
+
+  if(options.get()[THREADS]) {
+    string t_str = options.get()[THREADS].last()->arg;
+    istringstream(t_str) >> threads;
+  }
+  threads = resolve_thread_count(threads);
+
+  if(options.get()[STATS_JSON]) {
+    stats_path = options.get()[STATS_JSON].last()->arg;
+  }
+
+  if(options.get()[TRACE]) {
+    trace_path = options.get()[TRACE].last()->arg;
+    trace_start();
+  }
+
+  unique_ptr<FeatureCache> cache;
+  if(!cache_dir.empty()) {
+    cache.reset(new FeatureCache(cache_dir, (unsigned long long)cache_mb << 20,
+                                 HogExtractor(Size(image_x, image_y)).signature()));
+    if(!cache->open()) {
+      fprintf(stderr, "Couldn't open feature cache '%s'.\n", cache_dir.c_str());
+      return 1;
+    }
+    fprintf(stderr, "Using feature cache '%s'...\n", cache_dir.c_str());
+  }
+
   string svm_path = parse.nonOption(0);
 
-  CvSVM svm;
+  LinearSVM svm;
   svm.load(svm_path.c_str());
   auto params = svm.get_params();
   auto svm_type = svm_type_as_string(params.svm_type);
@@ -162,29 +456,68 @@ int main(int argc, char* argv[]) {
         svm_c, svm_gamma, svm_nu, svm_coef0, svm_degree);
   printf("\n");
 
-  vector<string> imagePaths;
-  fprintf(stderr, "Using positive test image directory '%s'...\n", pos_dir.c_str());
-  if(!get_image_paths_into(pos_dir, imagePaths)) {
-    fprintf(stderr, "Couldn't open positive test image directory '%s'.\n", pos_dir.c_str());
+  unsigned int wrong_pos;
+  size_t num_pos;
+  bool failed = false;
+  if(!test_features_files(pos_dir, svm, true, threads, wrong_pos, num_pos, failed)) {
+    fprintf(stderr, "Using positive test images from '%s'...\n", pos_dir.c_str());
+    unique_ptr<ImageStream> stream = open_image_stream(pos_dir, order, prefetch);
+    if(!stream) {
+      fprintf(stderr, "Couldn't open positive test image directory or archive '%s'.\n", pos_dir.c_str());
+      return 1;
+    }
+    if(stream->counted()) {
+      fprintf(stderr, "Found %llu positive test images.\n", stream->total());
+    }
+    size_t seen;
+    wrong_pos = process_images(*stream, image_x, image_y, svm, true, cache.get(), seen, num_pos);
+    if(stream->skipped() > 0) {
+      fprintf(stderr, "Skipped %zu files that aren't images.\n", stream->skipped());
+    }
+    if(num_pos < seen) {
+      printf("Skipped %zu positive test images that couldn't be read.\n", seen - num_pos);
+    }
+  }
+  if(failed) {
     return 1;
   }
-  auto num_pos = imagePaths.size();
-  fprintf(stderr, "Found %zu positive test images.\n", num_pos);
-  unsigned int wrong_pos = process_images(imagePaths, image_x, image_y, svm, true);
   printf("Misclassified %u of %zu positive images (%.2f%% accuracy).\n", wrong_pos, num_pos, ((float)num_pos - (float)wrong_pos) / (float)num_pos * 100.0);
   fprintf(stderr, "\n");
 
-  imagePaths.clear();
-  fprintf(stderr, "Using negative test image directory '%s'...\n", neg_dir.c_str());
-  if(!get_image_paths_into(neg_dir, imagePaths)) {
-    fprintf(stderr, "Couldn't open negative test image directory '%s'\n", neg_dir.c_str());
+  unsigned int wrong_neg;
+  size_t num_neg;
+  if(!test_features_files(neg_dir, svm, false, threads, wrong_neg, num_neg, failed)) {
+    fprintf(stderr, "Using negative test images from '%s'...\n", neg_dir.c_str());
+    unique_ptr<ImageStream> stream = open_image_stream(neg_dir, order, prefetch);
+    if(!stream) {
+      fprintf(stderr, "Couldn't open negative test image directory or archive '%s'\n", neg_dir.c_str());
+      return 1;
+    }
+    if(stream->counted()) {
+      fprintf(stderr, "Found %llu negative test images.\n", stream->total());
+    }
+    size_t seen;
+    wrong_neg = process_images(*stream, image_x, image_y, svm, false, cache.get(), seen, num_neg);
+    if(stream->skipped() > 0) {
+      fprintf(stderr, "Skipped %zu files that aren't images.\n", stream->skipped());
+    }
+    if(num_neg < seen) {
+      printf("Skipped %zu negative test images that couldn't be read.\n", seen - num_neg);
+    }
+  }
+  if(failed) {
     return 1;
   }
-  auto num_neg = imagePaths.size();
-  fprintf(stderr, "Found %zu negative test images.\n", num_neg);
-  unsigned int wrong_neg = process_images(imagePaths, image_x, image_y, svm, false);
   printf("Misclassified %u of %zu negative images (%.2f%% accuracy).\n", wrong_neg, num_neg, ((float)num_neg - (float)wrong_neg) / (float)num_neg * 100.0);
 
+  if(cache) {
+    cache->trim();
+  }
+
+  stats_report("hog_run", stats_path);
+  if(!trace_path.empty()) {
+    trace_write("hog_run", trace_path);
+  }
 
   return 0;
 }
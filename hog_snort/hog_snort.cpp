@@ -8,12 +8,27 @@
 #include <stdlib.h>
 #include <dirent.h>
 #include <fstream>
+#include <limits>
 #include <sstream>
 #include <memory>
+#include <new>
+#include <thread>
+#include <zlib.h>
 #include <opencv2/opencv.hpp>
 
+#include "../common/ht_cache.hpp"
 #include "../common/ht_common.hpp"
-#include "../common/ht_image_paths.hpp"
+#include "../common/ht_dtype.hpp"
+#include "../common/ht_features.hpp"
+#include "../common/ht_hog.hpp"
+#include "../common/ht_image_source.hpp"
+#include "../common/ht_io_order.hpp"
+#include "../common/ht_manifest.hpp"
+#include "../common/ht_pipeline.hpp"
+#include "../common/ht_quantize.hpp"
+#include "../common/ht_shards.hpp"
+#include "../common/ht_stats.hpp"
+#include "../common/ht_threads.hpp"
 
 using namespace cv;
 using namespace std;
@@ -23,61 +38,434 @@ const option::Descriptor usage[] =
   {UNKNOWN, 0, "", "", Arg::Unknown, "USAGE: hog_snort [options] feature_file\n\n"
                                      "Options:" },
   {HELP, 0, "", "help", Arg::None, "  --help  \t\tPrint this text." },
-  {POS_PATH, 0, "p", "path", Arg::Path, "  --path <path>, \t-p <path>  \tSpecifies the path for the image examples (default: pos)."},
+  {POS_PATH, 0, "p", "path", Arg::Path, "  --path <path>, \t-p <path>  \tSpecifies the directory, tar or zip archive holding the image examples (default: pos)."},
   {SIZE_X, 0, "x", "", Arg::Numeric, "  -x <n>  \t\tSpecifies an X height for the image examples in pixels (default: 64)."},
   {SIZE_Y, 0, "y", "", Arg::Numeric, "  -y <n>  \t\tSpecifies a Y height for the images examples in pixels (default: 128)."},
+  {THREADS, 0, "t", "threads", Arg::Count, "  --threads <n>, \t-t <n>  \tSpecifies the number of worker threads per stage; 0 uses every core (default: 1, to keep memory use low; hog_trainer defaults to every core)."},
+  {APPEND, 0, "a", "append", Arg::None, "  --append, \t-a  \tOnly ingest new or changed images into an existing features file, and tombstone the rows of deleted ones."},
+  {CACHE_DIR, 0, "", "cache", Arg::Path, "  --cache <dir>  \t\tReuse and store features in a cache directory shared between runs and tools."},
+  {CACHE_SIZE, 0, "", "cache-size", Arg::Numeric, "  --cache-size <MB>  \t\tSpecifies the size cap for the feature cache in megabytes (default: 1024)."},
+  {ORDER, 0, "", "order", Arg::Path, "  --order <mode>  \t\tProcesses images in 'path', 'inode' or on-disk 'extent' order (default: path)."},
+  {PREFETCH, 0, "", "prefetch", Arg::Numeric, "  --prefetch <n>  \t\tAsks the kernel to read ahead this many images before they are needed (default: 0)."},
+  {COMPRESS, 0, "z", "compress", Arg::None, "  --compress, \t-z  \tCompresses the features file in independently compressed blocks of rows."},
+  {SHARDS, 0, "", "shards", Arg::Numeric, "  --shards <n>  \t\tWrites the features to n shard files in parallel, and a list of them to feature_file (default: 1, or the shards of the file being appended to)."},
+  {MIRROR, 0, "", "mirror", Arg::None, "  --mirror  \t\tAlso writes a row for every image mirrored left to right, made by permuting its descriptor."},
+  {WINDOWS, 0, "", "windows", Arg::Numeric, "  --windows <n>  \t\tTakes n windows at random from every image at full size, instead of resizing it to one window; gradients and histograms are computed once per image."},
+  {WINDOW_STRIDE, 0, "", "window-stride", Arg::Numeric, "  --window-stride <px>  \t\tTakes windows from every image at full size on a grid with this stride, a multiple of 8; without --windows, every window on the grid is taken, up to 1024 (default: 8)."},
+  {SEED, 0, "", "seed", Arg::Numeric, "  --seed <n>  \t\tSeeds the choice of windows; the same seed and image content always give the same windows (default: 0)."},
+  {STATS_JSON, 0, "", "stats-json", Arg::Path, "  --stats-json <file>  \t\tAlso writes the per-stage timings and throughput printed at exit to a JSON file."},
+  {TRACE, 0, "", "trace", Arg::Path, "  --trace <file>  \t\tWrites a timeline of every thread's work in the Chrome trace event format, for chrome://tracing or ui.perfetto.dev."},
+  {DTYPE, 0, "", "dtype", Arg::Path, "  --dtype <type>  \t\tStores features as 'f32', half precision 'f16' or 'bf16', or quantized to 8 bits 'u8' (default: f32, or the type of the file being appended to)."},
   {0, 0, 0, 0, 0, 0}
 };
 
-void write_headers(bool valid, int length, int width, ofstream &f) {
-  f.seekp(0);
+// Mark row 'r' of a file as deleted by overwriting its first element with
+// NaN, or setting the flag byte of a quantized row; hog_trainer skips such
+// rows.
+void tombstone_row(const FeatureHeader &header, uint64_t r, ostream &f) {
+  const float nan = numeric_limits<float>::quiet_NaN();
+  char tombstone[sizeof(float)] = {1};
+  uint64_t at = header.width * header.elementSize;
+  if(header.dtype != FEATURE_U8) {
+    narrow_features(&nan, 1, (FeatureType)header.dtype, tombstone);
+    at = 0;
+  }
+  f.seekp(header.dataOffset + r * header.rowStride + at);
+  f.write(tombstone, header.elementSize);
+}
 
-  if(valid) {
-    f.write("HOGSNRT", 7);
+// Lay out one row of features as 'header' says, at 'row'. The padding after
+// the elements (and the flag byte of quantized rows) is left alone. Returns
+// the number of elements clamped to the range of the scale table.
+size_t encode_row(const FeatureHeader &header, const QuantizationTable *table, const float *features, char *row) {
+  if(header.dtype == FEATURE_U8) {
+    return table->quantize(features, (uint8_t *)row);
   }
-  else {
-    f.write("INVALID", 7);
+  narrow_features(features, header.width, (FeatureType)header.dtype, row);
+  return 0;
+}
+
+// Rows queued per file before write() waits for its writer.
+const size_t HT_OUTPUT_QUEUE_ROWS = 64;
+
+typedef BoundedQueue<vector<char> > RowQueue;
+
+// The queue's indices are cache-line aligned, which plain new doesn't
+// guarantee before C++17.
+struct RowQueueDeleter {
+  void operator()(RowQueue *queue) const {
+    queue->~RowQueue();
+    free(queue);
+  }
+};
+
+static RowQueue *new_row_queue(size_t capacity) {
+  void *memory = NULL;
+  if(posix_memalign(&memory, alignof(RowQueue), sizeof(RowQueue)) != 0) {
+    throw bad_alloc();
   }
-  f.write((char *)&length, sizeof(int));
-  f.write((char *)&width, sizeof(int));
+  return new(memory) RowQueue(capacity, 1);
 }
 
-void process_images(vector<string>& imagePaths,
-            unsigned int size_x, unsigned int size_y, ofstream &featureFile) {
-  unsigned int row = 0;
-  unsigned int column = 0;
+// The files the rows of a features file go to: the file itself or, with
+// --shards, its shards, row r of the set being row r / n of shard r % n. Each
+// file gets a writer thread fed through a bounded queue, so the files are
+// written in parallel and the pipeline's sink only lays rows out. Writers of
+// compressed files gather the rows into blocks as they arrive, and compress a
+// batch of blocks at a time in parallel before writing them out in order.
+class FeatureOutput {
+public:
+  // New, empty files at 'paths' for rows laid out as 'layout' says.
+  bool create(const vector<string> &paths, const FeatureHeader &layout) {
+    shards.clear();
+    header = layout;
+    header.rows = 0;
+    for(auto &path : paths) {
+      shards.emplace_back(new Shard());
+      Shard &s = *shards.back();
+      s.header = header;
+      s.file.open(path, fstream::in | fstream::out | fstream::trunc | fstream::binary);
+      if(!s.file.is_open()) {
+        return false;
+      }
+    }
+    return true;
+  }
 
-  auto totalPaths = imagePaths.size();
-  fprintf(stderr, "Found %zu examples.\n", totalPaths);
+  // Existing files to add rows to. Only uncompressed version 2 files with the
+  // same layout, holding the rows of one set, are taken.
+  bool reopen(const vector<string> &paths, const char **error) {
+    shards.clear();
+    uint64_t rows = 0;
+    for(auto &path : paths) {
+      shards.emplace_back(new Shard());
+      Shard &s = *shards.back();
+      const FeatureHeader &first = shards[0]->header;
+      s.file.open(path, fstream::in | fstream::out | fstream::binary);
+      if(!s.file.is_open()) {
+        *error = "couldn't open a shard";
+        return false;
+      }
+      if(!read_feature_header(s.file, s.header, error)) {
+        return false;
+      }
+      if(s.header.version != 2 || s.header.compression != COMPRESSION_NONE) {
+        *error = "not an uncompressed version 2 file";
+        return false;
+      }
+      if(s.header.dtype != first.dtype || s.header.width != first.width ||
+         s.header.rowStride != first.rowStride || s.header.dataOffset != first.dataOffset ||
+         s.header.windowWidth != first.windowWidth || s.header.windowHeight != first.windowHeight) {
+        *error = "shards with different layouts";
+        return false;
+      }
+      rows = rows + s.header.rows;
+    }
+    if(shards.empty()) {
+      *error = "no shards";
+      return false;
+    }
+    for(size_t s = 0; s < shards.size(); ++s) {
+      if(shards[s]->header.rows != shard_rows(s, rows)) {
+        *error = "shards that don't hold one set of rows";
+        return false;
+      }
+    }
+    header = shards[0]->header;
+    header.rows = rows;
+    return true;
+  }
 
-  // Preallocate space in the file for the headers:
-  write_headers(false, 0, 0, featureFile);
+  size_t size() const {
+    return shards.size();
+  }
 
-  saveCursor();
-  for(auto path : imagePaths) {
-    restoreCursor();
-    progress(row, totalPaths, "Processing examples...");
+  fstream &file(size_t s) {
+    return shards[s]->file;
+  }
+
+  FeatureHeader &shard_header(size_t s) {
+    return shards[s]->header;
+  }
+
+  // The number of rows of shard s in a set of 'rows' rows.
+  uint64_t shard_rows(size_t s, uint64_t rows) const {
+    return (rows + shards.size() - 1 - s) / shards.size();
+  }
+
+  void tombstone(const ManifestEntry &e) {
+    for(unsigned long long r = e.row; r < e.row + e.rows; ++r) {
+      Shard &s = *shards[r % shards.size()];
+      tombstone_row(s.header, r / shards.size(), s.file);
+      s.header.tombstoned = s.header.tombstoned + 1;
+    }
+  }
+
+  // Mark the files invalid until end(), and start a writer after the
+  // existing rows of each. Compressed files are compressed on 'threads'
+  // threads in all.
+  void begin(unsigned int threads) {
+    const uint64_t n = shards.size();
+    const unsigned int compressors = max(1u, threads / (unsigned int)n);
+    for(uint64_t i = 0; i < n; ++i) {
+      Shard *s = shards[i].get();
+      write_feature_header(s->header, false, s->file);
+      s->file.seekp(s->header.dataOffset + s->header.rows * s->header.rowStride);
+      s->queue.reset(new_row_queue(HT_OUTPUT_QUEUE_ROWS));
+      s->offset = s->header.dataOffset;
+      s->index.clear();
+      s->failed = false;
+      const uint64_t first = s->header.rows;
+      s->writer = thread([s, i, n, first, compressors]() {
+        trace_thread_name("writer");
+        if(s->header.compression != COMPRESSION_NONE) {
+          s->write_blocks(compressors);
+          return;
+        }
+        vector<char> row;
+        for(uint64_t r = first; s->queue->pop(row); ++r) {
+          StageTimer timer(STAT_WRITE, row.size(), r * n + i);
+          s->file.write(row.data(), row.size());
+        }
+      });
+    }
+  }
+
+  // Queue a laid-out row as the next row of the set; 'row' is moved from.
+  void write(vector<char> &row) {
+    Shard &s = *shards[header.rows % shards.size()];
+    s.queue->push(row);
+    s.header.rows = s.header.rows + 1;
+    header.rows = header.rows + 1;
+  }
+
+  // The scale table to store in quantized files at end().
+  void set_table(const QuantizationTable &t) {
+    table = t;
+  }
+
+  // Wait for the writers, write the block index of compressed files and any
+  // new scale table, and write the real headers.
+  bool end() {
+    bool ok = true;
+    for(auto &s : shards) {
+      s->stop();
+      if(s->header.compression != COMPRESSION_NONE) {
+        s->header.indexOffset = s->offset;
+        s->file.seekp(s->offset);
+        s->file.write((const char *)s->index.data(), s->index.size() * sizeof(FeatureBlock));
+      }
+      if(table.width() > 0) {
+        table.write(s->header, s->file);
+      }
+      write_feature_header(s->header, true, s->file);
+      ok = ok && !s->failed && !s->file.fail();
+    }
+    return ok;
+  }
+
+  void close() {
+    for(auto &s : shards) {
+      s->file.close();
+    }
+  }
+
+  // The layout of the rows, and the number of rows in the whole set.
+  FeatureHeader header;
 
-    // Load the image and convert it to grayscale in one step:
-    auto image = imread(path, CV_LOAD_IMAGE_GRAYSCALE);
-    resize(image, image, Size(size_x, size_y));
+private:
+  struct Shard {
+    ~Shard() {
+      stop();
+    }
+
+    void stop() {
+      if(writer.joinable()) {
+        queue->close();
+        writer.join();
+      }
+    }
 
-    HOGDescriptor hog(Size(size_x, size_y), Size(16, 16), Size(8, 8), Size(8, 8), 9);
-    vector<float> v;
-    vector<Point> l;
-    hog.compute(image, v, Size(0,0), Size(0,0), l);
-    if(column == 0) {
-      column = v.size();
+    // Gather queued rows into blocks of header.blockRows, and compress
+    // 'threads' * 2 blocks at a time. The last block takes whatever is left.
+    void write_blocks(unsigned int threads) {
+      const size_t blockBytes = header.blockRows * header.rowStride;
+      vector<vector<char> > blocks(threads * 2), compressed(blocks.size());
+      vector<char> row;
+      bool more = true;
+      while(more) {
+        size_t full = 0;
+        for(; full < blocks.size() && more; ++full) {
+          blocks[full].clear();
+          while(blocks[full].size() < blockBytes && (more = queue->pop(row))) {
+            blocks[full].insert(blocks[full].end(), row.begin(), row.end());
+          }
+          if(blocks[full].empty()) {
+            break;
+          }
+        }
+        parallel_for(full, threads, [&](size_t b) {
+          StageTimer timer(STAT_COMPRESS, blocks[b].size(), index.size() + b);
+          uLongf length = compressBound(blocks[b].size());
+          compressed[b].resize(length);
+          if(compress2((Bytef *)compressed[b].data(), &length, (const Bytef *)blocks[b].data(),
+                       blocks[b].size(), 1) != Z_OK) {
+            length = 0;
+          }
+          compressed[b].resize(length);
+        }, "compressor");
+        for(size_t b = 0; b < full; ++b) {
+          if(compressed[b].empty()) {
+            fprintf(stderr, "\nCouldn't compress block %zu.\n", index.size());
+            failed = true;
+          }
+          StageTimer timer(STAT_WRITE, compressed[b].size(), index.size());
+          FeatureBlock block;
+          block.offset = offset;
+          block.length = compressed[b].size();
+          block.reserved = 0;
+          index.push_back(block);
+          file.write(compressed[b].data(), compressed[b].size());
+          offset = offset + compressed[b].size();
+        }
+      }
     }
-    featureFile.write((char *)v.data(), sizeof(float) * v.size());
 
-    row = row + 1;
-    // 'image' should be released here as it falls out of scope...
+    fstream file;
+    FeatureHeader header;
+    unique_ptr<RowQueue, RowQueueDeleter> queue;
+    thread writer;
+    // Where the next block goes, and the blocks written so far, in
+    // compressed files.
+    uint64_t offset;
+    vector<FeatureBlock> index;
+    bool failed;
+  };
+
+  vector<unique_ptr<Shard> > shards;
+  QuantizationTable table;
+};
+
+// Fit a scale table for quantized files to the range of every dimension of
+// every row the images of 'stream' give, mirrored rows included. This takes
+// a pass of its own over the images before any row is written; with a
+// cache, the pass that writes the rows is then all cache hits.
+QuantizationTable fit_scales(ImageStream &stream, unsigned int size_x, unsigned int size_y, unsigned int threads,
+                             size_t width, const FeatureCache *cache, const WindowSampler *sampler,
+                             const HogMirror *mirror) {
+  TraceSpan span("fit scales");
+  const unsigned long long step = stream.total() / 10000 + 1;
+  FeatureRange range(width);
+  vector<float> mirrored(width);
+  auto add = [&](PipelineItem &item) {
+    restoreCursor();
+    progress(item.position / step, stream.total() / step + (stream.counted() ? 0 : 1), "Fitting scales...");
+    if(!item.ok || item.features.size() % width != 0) {
+      return;
+    }
+    for(size_t at = 0; at < item.features.size(); at = at + width) {
+      range.add(item.features.data() + at);
+      if(mirror != NULL) {
+        mirror->apply(item.features.data() + at, mirrored.data());
+        range.add(mirrored.data());
+      }
+    }
+  };
+  saveCursor();
+  run_feature_pipeline(stream, Size(size_x, size_y), threads, add, cache, sampler);
+  fprintf(stderr, " Done.\n");
+  return range.table();
+}
+
+// Compute features for the images of 'stream', and write them after the
+// existing rows of 'output', recording each image in the manifest.
+// Quantized files need the 'table' to quantize with; values outside it are
+// clamped, and counted. With a window 'sampler', every image gives a row for
+// each window taken from it. With a 'mirror', every row is followed by one
+// for its mirror image.
+bool process_images(ImageStream& stream,
+            unsigned int size_x, unsigned int size_y, unsigned int threads,
+            FeatureOutput &output, Manifest &manifest, const FeatureCache *cache,
+            const QuantizationTable *table, const WindowSampler *sampler, const HogMirror *mirror) {
+  if(stream.counted()) {
+    fprintf(stderr, "Found %llu examples to process.\n", stream.total());
+  }
+  else {
+    fprintf(stderr, "Reading examples straight through the archive.\n");
+  }
+  // Archive positions are in bytes; scale them down to fit progress():
+  const unsigned long long step = stream.total() / 10000 + 1;
+  if(threads > 1) {
+    fprintf(stderr, "Using %u worker threads per stage.\n", threads);
   }
+  if(output.size() > 1) {
+    fprintf(stderr, "Writing %zu shards.\n", output.size());
+  }
+  fprintf(stderr, "Using %s HOG implementation.\n", HogExtractor(Size(size_x, size_y)).implementation());
+
+  const FeatureHeader &header = output.header;
+  output.begin(threads);
+
+  unsigned int cached = 0;
+  vector<float> mirrored(header.width);
+
+  unsigned long long clamped = 0;
+  auto emit = [&](const float *features) {
+    vector<char> row(header.rowStride, 0);
+    clamped = clamped + encode_row(header, table, features, row.data());
+    output.write(row);
+  };
+
+  // Rows are laid out by this thread in processing order, so the output
+  // doesn't depend on the number of workers:
+  auto write = [&](PipelineItem &item) {
+    restoreCursor();
+    progress(item.position / step, stream.total() / step + (stream.counted() ? 0 : 1), "Processing examples...");
+    size_t windows = item.features.size() / header.width;
+    if(!item.ok || item.features.size() % header.width != 0 || (windows == 0 && sampler == NULL)) {
+      fprintf(stderr, "\nCouldn't read image '%s', skipping...\n", item.name.c_str());
+      saveCursor();
+      return;
+    }
+    if(windows == 0) {
+      fprintf(stderr, "\nImage '%s' is smaller than the window, skipping...\n", item.name.c_str());
+      saveCursor();
+    }
+    if(item.cached) {
+      cached = cached + 1;
+    }
+
+    ManifestEntry e;
+    e.size = item.size;
+    e.mtime = item.mtime;
+    e.row = header.rows;
+    e.rows = windows * (mirror != NULL ? 2 : 1);
+    manifest[item.name] = e;
+    for(size_t w = 0; w < windows; ++w) {
+      const float *features = item.features.data() + w * header.width;
+      emit(features);
+      if(mirror != NULL) {
+        mirror->apply(features, mirrored.data());
+        emit(mirrored.data());
+      }
+    }
+  };
 
-  // Write the real headers to the beginning of the file:
-  write_headers(true, row, column, featureFile);
+  saveCursor();
+  run_feature_pipeline(stream, Size(size_x, size_y), threads, write, cache, sampler);
+
+  bool ok = output.end();
   fprintf(stderr, " Done.\n");
+  if(!stream.counted() && stream.skipped() > 0) {
+    fprintf(stderr, "Skipped %zu files that aren't images.\n", stream.skipped());
+  }
+  if(cache != NULL) {
+    fprintf(stderr, "Reused %u cached examples.\n", cached);
+  }
+  if(clamped > 0) {
+    fprintf(stderr, "Clamped %llu elements to the range of the scale table.\n", clamped);
+  }
+  return ok;
 }
 
 int main(int argc, char* argv[]) {
@@ -86,10 +474,27 @@ int main(int argc, char* argv[]) {
   unique_ptr<option::Option> options(new option::Option[stats.options_max]);
   unique_ptr<option::Option> buffer(new option::Option[stats.buffer_max]);
   option::Parser parse(usage, argc, argv, options.get(), buffer.get());
+  stats_start();
 
   string pos_dir = "pos";
   unsigned int image_x = 64;
   unsigned int image_y = 128;
+  unsigned int threads = 1;
+  bool append = false;
+  string cache_dir;
+  unsigned int cache_mb = HT_CACHE_DEFAULT_MB;
+  PathOrder order = ORDER_PATH;
+  size_t prefetch = 0;
+  FeatureType dtype = FEATURE_F32;
+  bool compress = false;
+  unsigned int shard_count = 1;
+  bool mirror_rows = false;
+  bool sample_windows = false;
+  unsigned int window_count = 0;
+  unsigned int window_stride = HogExtractor::BlockStride;
+  unsigned long long seed = 0;
+  string stats_path;
+  string trace_path;
 
   if(parse.error()) {
     return 1;
@@ -117,18 +522,318 @@ int main(int argc, char* argv[]) {
     istringstream(y_str) >> image_y;
   }
 
-  vector<string> imagePaths;
-  fprintf(stderr, "Using image directory '%s'...\n", pos_dir.c_str());
-  if(!get_image_paths_into(pos_dir, imagePaths)) {
-    fprintf(stderr, "Couldn't open image directory '%s'\n", pos_dir.c_str());
+  if(options.get()[THREADS]) {
+    string t_str = options.get()[THREADS].last()->arg;
+    istringstream(t_str) >> threads;
+  }
+  threads = resolve_thread_count(threads);
+
+  if(options.get()[APPEND]) {
+    append = true;
+  }
+
+  if(options.get()[CACHE_DIR]) {
+    cache_dir = options.get()[CACHE_DIR].last()->arg;
+  }
+
+  if(options.get()[CACHE_SIZE]) {
+    string c_str = options.get()[CACHE_SIZE].last()->arg;
+    istringstream(c_str) >> cache_mb;
+  }
+
+  if(options.get()[ORDER] && !parse_path_order(options.get()[ORDER].last()->arg, order)) {
+    fprintf(stderr, "Unknown processing order '%s'.\n", options.get()[ORDER].last()->arg);
     return 1;
   }
 
-  ofstream featureFile(feature_path, ofstream::binary);
-  process_images(imagePaths, image_x, image_y, featureFile);
+  if(options.get()[PREFETCH]) {
+    string f_str = options.get()[PREFETCH].last()->arg;
+    istringstream(f_str) >> prefetch;
+  }
 
-  printf("Wrote features to '%s'.\n", feature_path.c_str());
+  if(options.get()[COMPRESS]) {
+    compress = true;
+  }
+
+  if(options.get()[SHARDS]) {
+    string s_str = options.get()[SHARDS].last()->arg;
+    istringstream(s_str) >> shard_count;
+    if(shard_count < 1 || shard_count > 99999) {
+      fprintf(stderr, "The number of shards must be between 1 and 99999.\n");
+      return 1;
+    }
+  }
+
+  if(options.get()[MIRROR]) {
+    mirror_rows = true;
+  }
+
+  if(options.get()[WINDOWS]) {
+    string w_str = options.get()[WINDOWS].last()->arg;
+    istringstream(w_str) >> window_count;
+    sample_windows = true;
+    if(window_count > WindowSampler::MaxWindows) {
+      fprintf(stderr, "At most %d windows can be taken from an image.\n", (int)WindowSampler::MaxWindows);
+      return 1;
+    }
+  }
+
+  if(options.get()[WINDOW_STRIDE]) {
+    string s_str = options.get()[WINDOW_STRIDE].last()->arg;
+    istringstream(s_str) >> window_stride;
+    sample_windows = true;
+  }
+
+  if(options.get()[SEED]) {
+    string s_str = options.get()[SEED].last()->arg;
+    istringstream(s_str) >> seed;
+  }
+
+  if(options.get()[STATS_JSON]) {
+    stats_path = options.get()[STATS_JSON].last()->arg;
+  }
+
+  if(options.get()[TRACE]) {
+    trace_path = options.get()[TRACE].last()->arg;
+    trace_start();
+  }
+
+  if(options.get()[DTYPE] && !parse_feature_type(options.get()[DTYPE].last()->arg, dtype)) {
+    fprintf(stderr, "Unknown element type '%s'.\n", options.get()[DTYPE].last()->arg);
+    return 1;
+  }
+
+  unique_ptr<HogMirror> mirror;
+  if(mirror_rows) {
+    mirror.reset(new HogMirror(Size(image_x, image_y)));
+    if(!mirror->supported()) {
+      fprintf(stderr, "--mirror needs a window that tiles evenly into %dx%d blocks with a stride of %d.\n",
+              (int)HogExtractor::BlockSize, (int)HogExtractor::BlockSize, (int)HogExtractor::BlockStride);
+      return 1;
+    }
+  }
+
+  unique_ptr<WindowSampler> sampler;
+  string signature = HogExtractor(Size(image_x, image_y)).signature();
+  if(sample_windows) {
+    sampler.reset(new WindowSampler(Size(image_x, image_y), window_count, window_stride, seed));
+    if(!sampler->supported()) {
+      fprintf(stderr, "--windows needs a window that tiles evenly into %dx%d blocks with a stride of %d, and a window stride that is a multiple of %d.\n",
+              (int)HogExtractor::BlockSize, (int)HogExtractor::BlockSize, (int)HogExtractor::BlockStride,
+              (int)HogExtractor::BlockStride);
+      return 1;
+    }
+    signature = signature + " " + sampler->signature();
+  }
 
-  featureFile.close();
+  unique_ptr<FeatureCache> cache;
+  if(!cache_dir.empty()) {
+    cache.reset(new FeatureCache(cache_dir, (unsigned long long)cache_mb << 20, signature));
+    if(!cache->open()) {
+      fprintf(stderr, "Couldn't open feature cache '%s'.\n", cache_dir.c_str());
+      return 1;
+    }
+    fprintf(stderr, "Using feature cache '%s'...\n", cache_dir.c_str());
+  }
+
+  // --append needs every image's size and mtime before it reads any of them;
+  // otherwise, tar archives are read straight through, listing their
+  // members as they go.
+  size_t skipped = 0;
+  fprintf(stderr, "Using images from '%s'...\n", pos_dir.c_str());
+  unique_ptr<ImageSource> source;
+  unique_ptr<ImageStream> stream;
+  if(append) {
+    source = open_image_source(pos_dir, skipped);
+  }
+  else {
+    stream = open_image_stream(pos_dir, order, prefetch);
+    skipped = stream && stream->counted() ? stream->skipped() : 0;
+  }
+  if(!source && !stream) {
+    fprintf(stderr, "Couldn't open image directory or archive '%s'\n", pos_dir.c_str());
+    return 1;
+  }
+  if(skipped > 0) {
+    fprintf(stderr, "Skipped %zu files that aren't images.\n", skipped);
+  }
+
+  vector<ManifestEntry> imageStats(source ? source->size() : 0);
+  for(size_t i = 0; i < imageStats.size(); ++i) {
+    ManifestEntry &e = imageStats[i];
+    e.size = 0;
+    e.mtime = 0;
+    e.row = 0;
+    e.rows = 0;
+    source->stat(i, e.size, e.mtime);
+  }
+
+  string manifest_path = manifest_path_for(feature_path);
+  Manifest manifest;
+  FeatureHeader header = make_feature_header(image_x, image_y, HogExtractor::CellSize,
+                                             HogExtractor::BlockSize, HogExtractor::BlockStride,
+                                             HogExtractor::Bins, HogExtractor(Size(image_x, image_y)).descriptor_size(),
+                                             dtype);
+  FeatureOutput output;
+  bool appending = false;
+
+  if(append) {
+    // A sharded features file is a list of its shards:
+    vector<string> existing_paths;
+    if(!load_shard_list(feature_path, existing_paths)) {
+      existing_paths.assign(1, feature_path);
+    }
+    FeatureHeader existing;
+    const char *error = NULL;
+    ifstream existingFile;
+    if(!existing_paths.empty()) {
+      existingFile.open(existing_paths[0], ifstream::binary);
+    }
+    // Only uncompressed version 2 files are appended to; older ones are
+    // rebuilt, and so are compressed ones, which can't be changed in place.
+    bool valid = existingFile.is_open() && read_feature_header(existingFile, existing, &error);
+    existingFile.close();
+    if(valid && !options.get()[SHARDS]) {
+      shard_count = existing_paths.size();
+    }
+    if(valid && existing.compression != COMPRESSION_NONE) {
+      fprintf(stderr, "Features file '%s' is compressed and can't be appended to.\n", feature_path.c_str());
+      if(!options.get()[DTYPE] && existing.width == header.width) {
+        header = make_feature_header(image_x, image_y, HogExtractor::CellSize,
+                                     HogExtractor::BlockSize, HogExtractor::BlockStride,
+                                     HogExtractor::Bins, header.width, (FeatureType)existing.dtype);
+      }
+      compress = true;
+      valid = false;
+    }
+    else if(valid && compress) {
+      fprintf(stderr, "An existing features file can't be compressed in place.\n");
+      valid = false;
+    }
+    else if(valid && existing_paths.size() != shard_count) {
+      fprintf(stderr, "Features file '%s' has %zu shards, not %u.\n", feature_path.c_str(), existing_paths.size(), shard_count);
+      valid = false;
+    }
+    appending = valid && existing.version == 2 && load_manifest(manifest_path, manifest) &&
+                output.reopen(existing_paths, &error);
+    if(appending && (existing.windowWidth != image_x || existing.windowHeight != image_y ||
+                     existing.width != header.width)) {
+      fprintf(stderr, "Features file '%s' was built with a different window size.\n", feature_path.c_str());
+      return 1;
+    }
+    if(appending && options.get()[DTYPE] && existing.dtype != (uint32_t)dtype) {
+      fprintf(stderr, "Features file '%s' stores %s elements, not %s.\n", feature_path.c_str(),
+              feature_type_name(existing.dtype), feature_type_name(dtype));
+      return 1;
+    }
+    if(appending) {
+      header = output.header;
+    }
+    else {
+      fprintf(stderr, "No valid features file and manifest at '%s'; ingesting every image...\n", feature_path.c_str());
+      manifest.clear();
+    }
+  }
+  vector<string> shard_paths;
+  if(!appending) {
+    set_feature_compression(header, compress ? COMPRESSION_ZLIB : COMPRESSION_NONE);
+    for(unsigned int s = 0; s < shard_count; ++s) {
+      shard_paths.push_back(shard_count > 1 ? shard_path_for(feature_path, s, shard_count) : feature_path);
+    }
+    if(!output.create(shard_paths, header)) {
+      fprintf(stderr, "Couldn't open features file '%s'.\n", feature_path.c_str());
+      return 1;
+    }
+  }
+
+  // Work out which images are new or changed, and tombstone the rows of
+  // images that changed or disappeared since the last run:
+  vector<size_t> pending;
+  Manifest kept;
+  unsigned int tombstoned = 0;
+  for(size_t i = 0; i < imageStats.size(); ++i) {
+    auto old = manifest.find(source->name(i));
+    if(old != manifest.end()) {
+      if(old->second.size == imageStats[i].size && old->second.mtime == imageStats[i].mtime) {
+        kept.insert(*old);
+        manifest.erase(old);
+        continue;
+      }
+      output.tombstone(old->second);
+      tombstoned += old->second.rows;
+      manifest.erase(old);
+    }
+    pending.push_back(i);
+  }
+  for(auto &deleted : manifest) {
+    output.tombstone(deleted.second);
+    tombstoned += deleted.second.rows;
+  }
+  manifest.swap(kept);
+  if(appending) {
+    fprintf(stderr, "Keeping %zu unchanged examples; tombstoned %u rows.\n", manifest.size(), tombstoned);
+  }
+
+  if(source) {
+    source->order(pending, order);
+    stream.reset(new IndexedStream(*source, pending, prefetch));
+  }
+
+  unsigned long long startRows = header.rows;
+  // A new quantized file gets a scale table fitted to all of its rows, which
+  // takes a pass over the images of its own; rows appended later use the
+  // file's table.
+  QuantizationTable table;
+  if(header.dtype == FEATURE_U8 && appending && !table.read(header, output.file(0))) {
+    fprintf(stderr, "Couldn't read the scale table of '%s'.\n", feature_path.c_str());
+    return 1;
+  }
+  if(header.dtype == FEATURE_U8 && !appending) {
+    table = fit_scales(*stream, image_x, image_y, threads, header.width, cache.get(), sampler.get(), mirror.get());
+    output.set_table(table);
+    if(source) {
+      stream.reset(new IndexedStream(*source, pending, prefetch));
+    }
+    else {
+      stream = open_image_stream(pos_dir, order, prefetch);
+    }
+    if(!stream) {
+      fprintf(stderr, "Couldn't reopen image directory or archive '%s'\n", pos_dir.c_str());
+      return 1;
+    }
+  }
+  bool written = process_images(*stream, image_x, image_y, threads, output, manifest, cache.get(), &table, sampler.get(), mirror.get());
+  output.close();
+  if(!written) {
+    fprintf(stderr, "Couldn't write features file '%s'.\n", feature_path.c_str());
+    return 1;
+  }
+  if(shard_count > 1 && !appending && !save_shard_list(feature_path, shard_paths)) {
+    fprintf(stderr, "Couldn't write shard list '%s'.\n", feature_path.c_str());
+    return 1;
+  }
+  if(cache) {
+    cache->trim();
+  }
+
+  if(!save_manifest(manifest_path, manifest)) {
+    fprintf(stderr, "Couldn't write manifest '%s'.\n", manifest_path.c_str());
+    return 1;
+  }
+
+  stats_report("hog_snort", stats_path);
+  if(!trace_path.empty()) {
+    trace_write("hog_snort", trace_path);
+  }
+
+  if(appending) {
+    printf("Appended %llu rows to '%s'.\n", (unsigned long long)output.header.rows - startRows, feature_path.c_str());
+    return 0;
+  }
+  if(shard_count > 1) {
+    printf("Wrote features to '%s' in %u shards.\n", feature_path.c_str(), shard_count);
+    return 0;
+  }
+  printf("Wrote features to '%s'.\n", feature_path.c_str());
   return 0;
 }
@@ -6,11 +6,26 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <atomic>
 #include <memory>
-#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <vector>
 #include <opencv2/opencv.hpp>
 
 #include "../common/ht_common.hpp"
+#include "../common/ht_dcd.hpp"
+#include "../common/ht_dtype.hpp"
+#include "../common/ht_features.hpp"
+#include "../common/ht_feature_map.hpp"
+#include "../common/ht_linear.hpp"
+#include "../common/ht_quantize.hpp"
+#include "../common/ht_search.hpp"
+#include "../common/ht_sgd.hpp"
+#include "../common/ht_shards.hpp"
+#include "../common/ht_stats.hpp"
+#include "../common/ht_threads.hpp"
 
 using namespace cv;
 using namespace std;
@@ -20,47 +35,192 @@ const option::Descriptor usage[] =
   {UNKNOWN, 0, "", "", Arg::Unknown, "USAGE: hog_trainer [options] svm_file\n\n"
                                      "Options:" },
   {HELP, 0, "", "help", Arg::None, "  --help  \tPrint this text." },
-  {POS_PATH, 0, "p", "pos", Arg::Path, "  --pos <path>, \t-p <path>  \tSpecifies the positive feature file."},
-  {NEG_PATH, 0, "n", "neg", Arg::Path, "  --neg <path>, \t-n <path>  \tSpecifies the negative feature file."},
-  {AUTO_TRAIN, 0, "a", "auto", Arg::None, "  --auto, \t -a  \tAutomatically set HOG model parameters (may be unstable)."},
+  {POS_PATH, 0, "p", "pos", Arg::Path, "  --pos <path>, \t-p <path>  \tSpecifies a positive features file, shard list or quoted wildcard pattern; may be given more than once (default: positive.bin)."},
+  {NEG_PATH, 0, "n", "neg", Arg::Path, "  --neg <path>, \t-n <path>  \tSpecifies a negative features file, shard list or quoted wildcard pattern; may be given more than once (default: negative.bin)."},
+  {AUTO_TRAIN, 0, "a", "auto", Arg::None, "  --auto, \t -a  \tChooses C by cross-validating a grid of values in parallel, then trains with the dcd solver."},
+  {CV, 0, "", "cv", Arg::Numeric, "  --cv <k>  \tReports the accuracy of k-fold cross-validation before training, with the folds trained in parallel by the dcd solver (which stands in for cvsvm); with --auto, sets the number of folds it uses instead (default: 5)."},
+  {C_GRID, 0, "", "c-grid", Arg::Path, "  --c-grid <min:max:step>  \tSpecifies the values of C tried by --auto, from min up to max by a factor of step (default: 0.0001:10:4)."},
+  {SEARCH_MEMORY, 0, "", "search-memory", Arg::Numeric, "  --search-memory <MB>  \tLimits the solver state --auto keeps for the folds it trains at once, besides the examples themselves (default: 1024)."},
+  {SOLVER, 0, "", "solver", Arg::Path, "  --solver <name>  \tTrains with CvSVM's 'cvsvm' solver, the far faster linear 'dcd' (dual coordinate descent) solver, or the 'sgd' solver, which streams the features files instead of loading them (default: cvsvm)."},
+  {LOSS, 0, "", "loss", Arg::Path, "  --loss <l1|l2>  \tSpecifies the hinge ('l1') or squared hinge ('l2') loss for the dcd solver (default: l2)."},
+  {PASSES, 0, "", "passes", Arg::Numeric, "  --passes <n>  \tSpecifies the number of passes the sgd solver makes over the features files (default: 5)."},
+  {DETECTOR, 0, "", "detector", Arg::Path, "  --detector <file>  \tAlso writes the model as a single weight vector followed by the bias, the layout HOGDescriptor::setSVMDetector() takes."},
+  {THREADS, 0, "t", "threads", Arg::Count, "  --threads <n>, \t-t <n>  \tSpecifies the number of threads used to load features and by --auto and --cv; 0 uses every core (default: 0, every core; hog_snort defaults to 1)."},
+  {STATS_JSON, 0, "", "stats-json", Arg::Path, "  --stats-json <file>  \tAlso writes the per-stage timings and throughput printed at exit to a JSON file."},
+  {TRACE, 0, "", "trace", Arg::Path, "  --trace <file>  \tWrites a timeline of every thread's work in the Chrome trace event format, for chrome://tracing or ui.perfetto.dev."},
   {0, 0, 0, 0, 0, 0}
 };
 
-bool open_features(unsigned int &length, unsigned int &width, ifstream &f, const char *label) {
-  char header[8];
-  f.read(header, 7);
-  header[7] = '\0';
-  if(strcmp("HOGSNRT", header) != 0) {
-    fprintf(stderr, "Invalid %s features file header\n", label);
+bool open_features(MappedFeatures &file, const string &path, const char *label, FeatureAccess access) {
+  const char *error = "";
+  if(!file.open(path, &error, access)) {
+    fprintf(stderr, "Couldn't use %s features file '%s' (%s).\n", label, path.c_str(), error);
+    return false;
+  }
+  fprintf(stderr, "Using %s features file '%s'...\n", label, path.c_str());
+  const FeatureHeader &header = file.header();
+  if(header.rows > (uint64_t)INT_MAX || header.width > (uint64_t)INT_MAX) {
+    fprintf(stderr, "Too many %s examples or features per example.\n", label);
     return false;
   }
 
-  f.read((char *)&length, sizeof(int));
-  f.read((char *)&width, sizeof(int));
-  fprintf(stderr, "Found %d %s examples...\n", length, label);
+  fprintf(stderr, "Found %llu %s examples (HOGSNRT version %u)...\n", (unsigned long long)header.rows, label, header.version);
+  if(header.version >= 2) {
+    fprintf(stderr, "HOG parameters: %ux%u window, %u pixel blocks with stride %u, %u pixel cells, %u bins, %s elements%s.\n",
+            header.windowWidth, header.windowHeight, header.blockSize, header.blockStride,
+            header.cellSize, header.bins, feature_type_name(header.dtype),
+            file.compressed() ? " (compressed)" : "");
+  }
 
   return true;
 }
 
-bool read_features_into(unsigned int length, unsigned int width, unsigned int start, ifstream &f, Mat &features, const char *label)  {
+// Windows and layout have to match for both sets to go into one model.
+// Version 1 files don't record them, so only their widths can be compared.
+bool compatible_features(const FeatureHeader &a, const FeatureHeader &b) {
+  if(a.width != b.width) {
+    return false;
+  }
+  if(a.version < 2 || b.version < 2) {
+    return true;
+  }
+  return a.windowWidth == b.windowWidth && a.windowHeight == b.windowHeight &&
+         a.cellSize == b.cellSize && a.blockSize == b.blockSize &&
+         a.blockStride == b.blockStride && a.bins == b.bins;
+}
+
+// The features files named by every occurrence of an option, or 'fallback'.
+vector<string> feature_paths(option::Option *opt, const string &fallback) {
+  vector<string> paths;
+  for(; opt != NULL; opt = opt->next()) {
+    vector<string> expanded = expand_feature_paths(opt->arg);
+    paths.insert(paths.end(), expanded.begin(), expanded.end());
+  }
+  if(paths.empty()) {
+    paths.push_back(fallback);
+  }
+  return paths;
+}
+
+// One features file and the label its examples are trained with.
+struct TrainingSet {
+  MappedFeatures file;
+  QuantizationTable table;
+  const char *label;
+  float response;
+};
+
+// Loads every set into one training matrix and its labels, in set order.
+// Both are allocated once, at their final size, so nothing is reallocated
+// or copied twice. Rows are handled a block at a time (see MappedFeatures),
+// on 'threads' threads: a first pass counts the live rows of each block
+// (rows tombstoned by hog_snort --append are skipped; compressed files are
+// never tombstoned, so all of their rows are), which tells every block where its rows
+// go, and a second pass copies them there straight out of the page cache,
+// decompressing compressed blocks first: one memcpy per float row, a SIMD
+// widening pass for half and bfloat16 rows, or dequantization for 8-bit
+// rows. Fails if a compressed block is corrupt.
+bool load_training_sets(vector<TrainingSet> &sets, unsigned int threads, Mat &features, Mat &labels) {
+  struct Chunk {
+    size_t set;
+    uint64_t block;
+    uint64_t kept;
+    uint64_t start;
+  };
+
+  vector<Chunk> chunks;
+  for(size_t s = 0; s < sets.size(); ++s) {
+    for(uint64_t b = 0; b < sets[s].file.blocks(); ++b) {
+      Chunk c;
+      c.set = s;
+      c.block = b;
+      c.kept = 0;
+      c.start = 0;
+      chunks.push_back(c);
+    }
+  }
+
+  atomic<bool> corrupt(false);
+  parallel_for(chunks.size(), threads, [&](size_t i) {
+    static thread_local vector<char> scratch;
+    TraceSpan span("count rows");
+    Chunk &c = chunks[i];
+    const MappedFeatures &file = sets[c.set].file;
+    if(file.compressed()) {
+      c.kept = file.block_row_count(c.block);
+      return;
+    }
+    const char *rows = file.block(c.block, scratch);
+    if(rows == NULL) {
+      corrupt = true;
+      return;
+    }
+    for(uint64_t r = 0; r < file.block_row_count(c.block); ++r) {
+      if(!is_tombstoned_row(rows + r * file.header().rowStride, file.header())) {
+        c.kept = c.kept + 1;
+      }
+    }
+  }, "loader");
+
+  vector<uint64_t> kept(sets.size(), 0);
+  uint64_t total = 0;
+  for(auto &c : chunks) {
+    c.start = total;
+    total = total + c.kept;
+    kept[c.set] = kept[c.set] + c.kept;
+  }
+  for(size_t s = 0; s < sets.size(); ++s) {
+    uint64_t tombstoned = sets[s].file.header().rows - kept[s];
+    if(tombstoned > 0) {
+      fprintf(stderr, "Skipping %llu tombstoned %s examples.\n", (unsigned long long)tombstoned, sets[s].label);
+    }
+  }
+
+  int width = sets.empty() ? 0 : sets[0].file.header().width;
+  char progressMessage[255];
+  snprintf(progressMessage, 255, "Reading %llu examples...", (unsigned long long)total);
+  features.create(total, width, CV_32FC1);
+  labels.create(total, 1, CV_32FC1);
+  mutex progressLock;
+  size_t done = 0;
   saveCursor();
-  for(unsigned int r = 0; r < length; ++r) {
-    restoreCursor();
-    char progressMessage[255];
-    snprintf(progressMessage, 255, "Reading %s examples...", label);
-    progress(r, length, progressMessage);
-    for(unsigned int c = 0; c < width; ++c) {
-      float val;
-      f.read((char *)&val, sizeof(float));
-      if(f.bad()) {
-        fprintf(stderr, "Prematurely truncated %s examples file.\n", label);
-        return false;
+  parallel_for(chunks.size(), threads, [&](size_t i) {
+    static thread_local vector<char> scratch;
+    const Chunk &c = chunks[i];
+    const TrainingSet &set = sets[c.set];
+    const FeatureHeader &header = set.file.header();
+    FeatureType type = (FeatureType)header.dtype;
+    StageTimer timer(STAT_LOAD, set.file.block_row_count(c.block) * header.rowStride, c.start);
+    const char *rows = set.file.block(c.block, scratch);
+    if(rows == NULL) {
+      corrupt = true;
+      return;
+    }
+    uint64_t into = c.start;
+    for(uint64_t r = 0; r < set.file.block_row_count(c.block) && into < c.start + c.kept; ++r) {
+      const char *row = rows + r * header.rowStride;
+      if(is_tombstoned_row(row, header)) {
+        continue;
+      }
+      if(type == FEATURE_U8) {
+        set.table.dequantize((const uint8_t *)row, features.ptr<float>(into));
+      }
+      else {
+        widen_features(row, header.width, type, features.ptr<float>(into));
       }
-      features.row(r + start).col(c) = val;
+      labels.at<float>(into, 0) = set.response;
+      into = into + 1;
     }
+    lock_guard<mutex> lock(progressLock);
+    restoreCursor();
+    progress(done, chunks.size(), progressMessage);
+    done = done + 1;
+  }, "loader");
+  if(corrupt) {
+    fprintf(stderr, "\nA compressed block of the features files is corrupt.\n");
+    return false;
   }
   fprintf(stderr, " Done.\n");
-
   return true;
 }
 
@@ -70,10 +230,23 @@ int main(int argc, char* argv[]) {
   unique_ptr<option::Option> options(new option::Option[stats.options_max]);
   unique_ptr<option::Option> buffer(new option::Option[stats.buffer_max]);
   option::Parser parse(usage, argc, argv, options.get(), buffer.get());
+  stats_start();
 
-  string pos_path = "positive.bin";
-  string neg_path = "negative.bin";
+  vector<string> pos_paths;
+  vector<string> neg_paths;
   bool auto_train = false;
+  bool dcd = false;
+  DcdParams dcd_params;
+  bool sgd = false;
+  SgdParams sgd_params;
+  unsigned int folds = HT_SEARCH_FOLDS;
+  bool cross_validation = false;
+  SearchGrid grid;
+  size_t search_mb = HT_SEARCH_DEFAULT_MB;
+  unsigned int threads = 0;
+  string detector_path;
+  string stats_path;
+  string trace_path;
 
   if(parse.error()) {
     return 1;
@@ -87,79 +260,246 @@ int main(int argc, char* argv[]) {
 
   string svm_path = parse.nonOption(0);
 
-  if(options.get()[POS_PATH]) {
-    pos_path = options.get()[POS_PATH].last()->arg;
-  }
-
-  if(options.get()[NEG_PATH]) {
-    neg_path = options.get()[NEG_PATH].last()->arg;
-  }
+  pos_paths = feature_paths(options.get()[POS_PATH] ? options.get()[POS_PATH].first() : NULL, "positive.bin");
+  neg_paths = feature_paths(options.get()[NEG_PATH] ? options.get()[NEG_PATH].first() : NULL, "negative.bin");
 
   if(options.get()[AUTO_TRAIN]) {
     auto_train = true;
   }
 
-  //FileStorage positiveXml(pos_path, FileStorage::READ);
-  ifstream positiveFile(pos_path, ifstream::binary);
-  if(positiveFile.good()) {
-    fprintf(stderr, "Using positive features file '%s'...\n", pos_path.c_str());
+  if(options.get()[SOLVER]) {
+    string solver = options.get()[SOLVER].last()->arg;
+    if(solver == "dcd") {
+      dcd = true;
+    }
+    else if(solver == "sgd") {
+      sgd = true;
+    }
+    else if(solver != "cvsvm") {
+      fprintf(stderr, "Unknown solver '%s'.\n", solver.c_str());
+      return 1;
+    }
   }
-  else {
-    fprintf(stderr, "Couldn't open positive features file '%s'.\n", pos_path.c_str());
+
+  if(options.get()[LOSS] && !parse_dcd_loss(options.get()[LOSS].last()->arg, dcd_params.loss)) {
+    fprintf(stderr, "Unknown loss '%s'.\n", options.get()[LOSS].last()->arg);
     return 1;
   }
 
-  unsigned int p_length;
-  unsigned int width;
-  if(!open_features(p_length, width, positiveFile, "positive")) {
+  if(options.get()[PASSES]) {
+    string p_str = options.get()[PASSES].last()->arg;
+    istringstream(p_str) >> sgd_params.passes;
+    if(sgd_params.passes == 0) {
+      fprintf(stderr, "The sgd solver needs at least one pass.\n");
+      return 1;
+    }
+  }
+
+  if(auto_train) {
+    if(options.get()[SOLVER] && !dcd) {
+      fprintf(stderr, "--auto searches with the dcd solver.\n");
+      return 1;
+    }
+    dcd = true;
+  }
+
+  if(options.get()[CV]) {
+    string k_str = options.get()[CV].last()->arg;
+    istringstream(k_str) >> folds;
+    if(folds < 2) {
+      fprintf(stderr, "Cross-validation needs at least 2 folds.\n");
+      return 1;
+    }
+    if(sgd) {
+      fprintf(stderr, "--cv needs the training matrix, which the sgd solver doesn't load.\n");
+      return 1;
+    }
+    cross_validation = !auto_train;
+  }
+
+  if(options.get()[C_GRID] && !parse_search_grid(options.get()[C_GRID].last()->arg, grid)) {
+    fprintf(stderr, "Couldn't parse the C grid '%s'.\n", options.get()[C_GRID].last()->arg);
     return 1;
   }
-  printf("Found %d positive examples with %d features per example.\n", p_length, width);
 
-  Mat features(p_length, width, CV_32FC1);
-  read_features_into(p_length, width, 0, positiveFile, features, "positive");
-  positiveFile.close();
+  if(options.get()[SEARCH_MEMORY]) {
+    string m_str = options.get()[SEARCH_MEMORY].last()->arg;
+    istringstream(m_str) >> search_mb;
+  }
 
-  ifstream negativeFile(neg_path, ifstream::binary);
-  if(negativeFile.good()) {
-    fprintf(stderr, "Using negative features file '%s'...\n", neg_path.c_str());
+  if(options.get()[THREADS]) {
+    string t_str = options.get()[THREADS].last()->arg;
+    istringstream(t_str) >> threads;
   }
-  else {
-    fprintf(stderr, "Couldn't open negative features file '%s'.\n", neg_path.c_str());
+  threads = resolve_thread_count(threads);
+
+  if(options.get()[DETECTOR]) {
+    detector_path = options.get()[DETECTOR].last()->arg;
+  }
+
+  if(options.get()[STATS_JSON]) {
+    stats_path = options.get()[STATS_JSON].last()->arg;
+  }
+
+  if(options.get()[TRACE]) {
+    trace_path = options.get()[TRACE].last()->arg;
+    trace_start();
+  }
+
+  // Every header is read before anything is allocated, so the training
+  // matrix can be sized once for all of the examples. Every file (or shard)
+  // is a set of its own, so shards are loaded concurrently.
+  vector<TrainingSet> sets(pos_paths.size() + neg_paths.size());
+  uint64_t p_rows = 0;
+  uint64_t n_rows = 0;
+  for(size_t i = 0; i < sets.size(); ++i) {
+    bool positive = i < pos_paths.size();
+    TrainingSet &set = sets[i];
+    set.label = positive ? "positive" : "negative";
+    set.response = positive ? 1.0 : -1.0;
+    if(!open_features(set.file, positive ? pos_paths[i] : neg_paths[i - pos_paths.size()], set.label,
+                      sgd ? ACCESS_STREAMED : ACCESS_SEQUENTIAL)) {
+      return 1;
+    }
+    if(!compatible_features(sets[0].file.header(), set.file.header())) {
+      fprintf(stderr, "The features files were built with different HOG parameters.\n");
+      return 1;
+    }
+    if(set.file.header().dtype == FEATURE_U8) {
+      set.table = QuantizationTable(set.file.header(), set.file.data());
+    }
+    if(positive) {
+      p_rows = p_rows + set.file.header().rows;
+    }
+    else {
+      n_rows = n_rows + set.file.header().rows;
+    }
+  }
+  if(!sgd && p_rows + n_rows > (uint64_t)INT_MAX) {
+    fprintf(stderr, "Too many examples.\n");
     return 1;
   }
+  unsigned int width = sets[0].file.header().width;
+  printf("Found %llu positive examples with %d features per example.\n", (unsigned long long)p_rows, width);
+  printf("Found %llu negative examples with %d features per example.\n", (unsigned long long)n_rows, width);
+
+  // The sgd solver streams the files; the others train on all of the
+  // examples in memory.
+  Mat features;
+  Mat labels;
+  if(!sgd) {
+    if(!load_training_sets(sets, threads, features, labels)) {
+      return 1;
+    }
+    for(auto &set : sets) {
+      set.file.close();
+    }
+  }
 
-  unsigned int n_length;
-  if(!open_features(n_length, width, negativeFile, "negative")) {
+  if((auto_train || cross_validation) && (uint64_t)features.rows < folds) {
+    fprintf(stderr, "Too few examples for %u folds.\n", folds);
     return 1;
   }
-  printf("Found %d negative examples with %d features per example.\n", n_length, width);
 
-  features.resize(p_length + n_length);
-  read_features_into(n_length, width, p_length, negativeFile, features, "negative");
-  negativeFile.close();
+  if(cross_validation) {
+    // CvSVM can't train on a view of the training matrix, so its folds are
+    // trained by the dcd solver on the hinge loss CvSVM minimizes.
+    DcdParams cv_params = dcd_params;
+    if(!dcd && !options.get()[LOSS]) {
+      cv_params.loss = DCD_L1;
+    }
+    fprintf(stderr, "Cross-validating over %u folds...\n", folds);
+    // Say so when the folds aren't trained the way the model will be:
+    printf("Folds are trained by the dcd solver with the %s loss%s.\n", cv_params.loss == DCD_L1 ? "l1 (hinge)" : "l2",
+           dcd ? "" : ", standing in for cvsvm, which trains the saved model");
+    StageTimer timer(STAT_TRAIN, (uint64_t)features.rows * features.cols * sizeof(float));
+    vector<FoldResult> results = cross_validate(features, labels, folds, threads, cv_params);
+    vector<double> accuracy;
+    for(size_t f = 0; f < results.size(); ++f) {
+      printf("Fold %zu: %.2f%% accuracy, %d passes, %.2f s.\n", f + 1, results[f].accuracy * 100.0,
+             results[f].passes, results[f].seconds);
+      accuracy.push_back(results[f].accuracy);
+    }
+    printf("Cross-validated accuracy: %.2f%% (stddev %.2f%%) over %u folds.\n", mean_of(accuracy) * 100.0,
+           stddev_of(accuracy) * 100.0, folds);
+  }
 
-  Mat labels(p_length + n_length, 1, CV_32FC1, Scalar(-1.0));
-  labels.rowRange(0, p_length) = Scalar(1.0);
+  if(auto_train) {
+    StageTimer timer(STAT_TRAIN, (uint64_t)features.rows * features.cols * sizeof(float));
+    vector<SearchPoint> points = search_c(features, labels, grid, folds, threads, search_mb, dcd_params);
+    const SearchPoint &best = best_point(points);
+    printf("Chose C=%g (%.2f%% cross-validated accuracy).\n", best.C, mean_of(best.accuracy) * 100.0);
+    dcd_params.C = best.C;
+  }
 
   fprintf(stderr, "Training the HOG...");
-  CvSVM svm;
+  LinearSVM svm;
   CvSVMParams params;
   params.svm_type = CvSVM::C_SVC;
   params.kernel_type = CvSVM::LINEAR;
   params.term_crit = cvTermCriteria(CV_TERMCRIT_ITER, 100000, 1e-6);
-  if(!auto_train) {
-    params.C = 0.01;
-    svm.train(features, labels, Mat(), Mat(), params);
+  vector<float> w;
+  double bias = 0.0;
+  if(sgd) {
+    vector<StreamSet> streams;
+    for(auto &set : sets) {
+      StreamSet stream;
+      stream.file = &set.file;
+      stream.table = &set.table;
+      stream.response = set.response;
+      streams.push_back(stream);
+    }
+    params.C = sgd_params.C;
+    SgdResult result = train_sgd(streams, sgd_params, w, bias);
+    if(result.corrupt) {
+      fprintf(stderr, "\nA compressed block of the features files is corrupt.\n");
+      return 1;
+    }
+    fprintf(stderr, " %llu steps over %u passes...", (unsigned long long)result.steps, sgd_params.passes);
   }
   else {
-    svm.train_auto(features, labels, Mat(), Mat(), params);
+    StageTimer timer(STAT_TRAIN, (uint64_t)features.rows * features.cols * sizeof(float));
+    if(dcd) {
+      params.C = dcd_params.C;
+      params.term_crit = cvTermCriteria(CV_TERMCRIT_ITER | CV_TERMCRIT_EPS, dcd_params.maxPasses, dcd_params.epsilon);
+      DcdResult result = train_dcd(features, labels, dcd_params, w, bias);
+      fprintf(stderr, " %d passes, %d support vectors%s...", result.passes, result.supportVectors,
+              result.converged ? "" : " (stopped before converging)");
+    }
+    else {
+      params.C = 0.01;
+      svm.train(features, labels, Mat(), Mat(), params);
+      if(!detector_path.empty()) {
+        svm.collapse(w, bias);
+      }
+    }
   }
-  //svm.train_auto(features, labels, Mat(), Mat(), params);
   fprintf(stderr, " Done.\n");
 
-  svm.save(svm_path.c_str());
+  {
+    StageTimer timer(STAT_WRITE);
+    if(dcd || sgd) {
+      if(!save_linear_svm(svm_path, w, bias, params)) {
+        fprintf(stderr, "Couldn't write model '%s'.\n", svm_path.c_str());
+        return 1;
+      }
+    }
+    else {
+      svm.save(svm_path.c_str());
+    }
+    if(!detector_path.empty() && !save_detector(detector_path, w, bias)) {
+      fprintf(stderr, "Couldn't write detector '%s'.\n", detector_path.c_str());
+      return 1;
+    }
+  }
+  stats_report("hog_trainer", stats_path);
+  if(!trace_path.empty()) {
+    trace_write("hog_trainer", trace_path);
+  }
   printf("Wrote trained model to '%s'.\n", svm_path.c_str());
+  if(!detector_path.empty()) {
+    printf("Wrote detector to '%s'.\n", detector_path.c_str());
+  }
 
   labels.release();
   features.release();